@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "constants.h"
+
+// Shape of the generated workload
+struct Shape {
+  const char *dir;
+  int files;               // Number of .jobs files
+  long commands;           // Commands per file, after the CREATEs
+  unsigned int events;     // Events created at the start of each file
+  size_t rows, cols;       // Size of every venue
+  size_t reserveSize;      // Largest number of seats per RESERVE
+  double hotRatio;         // Fraction of the seats of a RESERVE taken from the hot seats
+  size_t hotSeats;         // Number of hot seats, the first ones of each venue
+  double showRatio;        // Fraction of the commands that are SHOW
+  double listRatio;        // Fraction of the commands that are LIST
+  long barrierEvery;       // Commands between BARRIERs, 0 for none
+  unsigned long seed;
+};
+
+static unsigned long long rng_state;
+
+/// Gets a pseudo random number, xorshift64*.
+static unsigned long long next_random() {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+/// Gets a pseudo random number in [0, 1).
+static double next_fraction() { return (double)(next_random() >> 11) / 9007199254740992.0; }
+
+/// Gets a pseudo random number in [0, n).
+static size_t next_below(size_t n) { return (size_t)(next_random() % n); }
+
+/// Writes a RESERVE of distinct seats.
+static void write_reserve(FILE *out, const struct Shape *shape) {
+  size_t seats[MAX_RESERVATION_SIZE];
+  size_t venue = shape->rows * shape->cols;
+  size_t hot = shape->hotSeats < venue ? shape->hotSeats : venue;
+  size_t count = 1 + next_below(shape->reserveSize);
+  if (count > venue) count = venue;
+
+  for (size_t i = 0; i < count; i++) {
+    int unique = 0;
+    while (!unique) {
+      seats[i] = hot > 0 && next_fraction() < shape->hotRatio ? next_below(hot) : next_below(venue);
+      unique = 1;
+      for (size_t j = 0; j < i && unique; j++) unique = seats[j] != seats[i];
+    }
+  }
+
+  fprintf(out, "RESERVE %u [", 1 + (unsigned int)next_below(shape->events));
+  for (size_t i = 0; i < count; i++) {
+    fprintf(out, "%s(%zu,%zu)", i ? " " : "", seats[i] / shape->cols + 1, seats[i] % shape->cols + 1);
+  }
+  fprintf(out, "]\n");
+}
+
+/// Writes one .jobs file.
+/// @return 0 if the file was written, 1 otherwise.
+static int write_file(const struct Shape *shape, int index) {
+  char path[strlen(shape->dir) + 32];
+  snprintf(path, sizeof(path), "%s/bench%04d.jobs", shape->dir, index);
+
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "open error: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  for (unsigned int e = 1; e <= shape->events; e++) fprintf(out, "CREATE %u %zu %zu\n", e, shape->rows, shape->cols);
+  if (shape->barrierEvery > 0) fprintf(out, "BARRIER\n");
+
+  for (long i = 1; i <= shape->commands; i++) {
+    double kind = next_fraction();
+    if (kind < shape->showRatio)
+      fprintf(out, "SHOW %u\n", 1 + (unsigned int)next_below(shape->events));
+    else if (kind < shape->showRatio + shape->listRatio)
+      fprintf(out, "LIST\n");
+    else
+      write_reserve(out, shape);
+
+    if (shape->barrierEvery > 0 && i % shape->barrierEvery == 0) fprintf(out, "BARRIER\n");
+  }
+
+  return fclose(out) != 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s -o <dir> [-f files] [-n commands] [-e events] [-r rows] [-c cols] [-s reserve_size]\n"
+          "          [-h hot_ratio] [-H hot_seats] [-S show_ratio] [-L list_ratio] [-b barrier_every] [-x seed]\n",
+          name);
+}
+
+int main(int argc, char *argv[]) {
+  struct Shape shape = {NULL, 1, 10000, 10, 100, 100, 8, 0.0, 16, 0.1, 0.01, 0, 1};
+
+  int option;
+  while ((option = getopt(argc, argv, "o:f:n:e:r:c:s:h:H:S:L:b:x:")) != -1) {
+    switch (option) {
+      case 'o': shape.dir = optarg; break;
+      case 'f': shape.files = atoi(optarg); break;
+      case 'n': shape.commands = atol(optarg); break;
+      case 'e': shape.events = (unsigned int)strtoul(optarg, NULL, 10); break;
+      case 'r': shape.rows = strtoul(optarg, NULL, 10); break;
+      case 'c': shape.cols = strtoul(optarg, NULL, 10); break;
+      case 's': shape.reserveSize = strtoul(optarg, NULL, 10); break;
+      case 'h': shape.hotRatio = atof(optarg); break;
+      case 'H': shape.hotSeats = strtoul(optarg, NULL, 10); break;
+      case 'S': shape.showRatio = atof(optarg); break;
+      case 'L': shape.listRatio = atof(optarg); break;
+      case 'b': shape.barrierEvery = atol(optarg); break;
+      case 'x': shape.seed = strtoul(optarg, NULL, 10); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  if (shape.dir == NULL || shape.files < 1 || shape.events < 1 || shape.rows < 1 || shape.cols < 1 ||
+      shape.reserveSize < 1 || shape.reserveSize > MAX_RESERVATION_SIZE) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (mkdir(shape.dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "mkdir error: %s\n", strerror(errno));
+    return 1;
+  }
+
+  rng_state = shape.seed * 0x9E3779B97F4A7C15ULL + 1;
+  for (int i = 0; i < shape.files; i++) {
+    if (write_file(&shape, i) != 0) return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Sweeps ems-bench over processes, threads and state delays on a generated workload.
+# Every setting can be overridden from the environment, for example:
+#   PROCS="1 4" THREADS="1 2 4 8" DELAYS="0" JOBGEN_ARGS="-f 8 -n 20000 -h 0.5" make bench
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=${WORK:-/tmp/ems-bench}
+PROCS=${PROCS:-"1 2 4"}
+THREADS=${THREADS:-"1 2 4 8"}
+DELAYS=${DELAYS:-"0 1"}
+JOBGEN_ARGS=${JOBGEN_ARGS:-"-f 4 -n 5000 -e 10 -r 100 -c 100 -s 8 -h 0.1 -S 0.1 -L 0.01 -b 1000"}
+EMS_ARGS=${EMS_ARGS:-""}
+
+rm -rf "$WORK"
+"$ROOT/bench/jobgen" -o "$WORK" $JOBGEN_ARGS
+commands=$(cat "$WORK"/*.jobs | wc -l)
+
+echo "workload: $JOBGEN_ARGS ($commands commands)"
+printf "%6s %8s %6s %10s %12s %10s %10s %10s\n" procs threads delay wall_ms cmds_per_s p50_us p99_us max_us
+for delay in $DELAYS; do
+  for procs in $PROCS; do
+    for threads in $THREADS; do
+      rm -f "$WORK"/*.out "$WORK"/*.stats
+      start=$(date +%s%N)
+      "$ROOT/ems-bench" --stats $EMS_ARGS "$WORK" "$procs" "$threads" "$delay" >/dev/null 2>&1
+      end=$(date +%s%N)
+
+      # Percentiles are the worst of the files, the per file histograms are in $WORK/*.stats
+      cat "$WORK"/*.stats | awk -v wall=$(( (end - start) / 1000 )) -v procs="$procs" -v threads="$threads" \
+          -v delay="$delay" '
+        $1 == "count" { count += $2 }
+        $1 == "p50_us" && $2 > p50 { p50 = $2 }
+        $1 == "p99_us" && $2 > p99 { p99 = $2 }
+        $1 == "max_us" && $2 > max { max = $2 }
+        END { printf "%6s %8s %6s %10.1f %12.0f %10.1f %10.1f %10.1f\n", procs, threads, delay, wall / 1e3,
+              count / (wall / 1e6), p50, p99, max }'
+    done
+  done
+done
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Sweeps the flush interval of the reservation log against threads, to relate commit latency to batch size.
+# Every setting can be overridden from the environment, for example:
+#   INTERVALS="0 100 1000" THREADS="1 8 32" make bench-wal
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=${WORK:-/tmp/ems-bench-wal}
+INTERVALS=${INTERVALS:-"0 200 1000 5000"}
+THREADS=${THREADS:-"1 4 16"}
+JOBGEN_ARGS=${JOBGEN_ARGS:-"-f 1 -n 5000 -e 10 -r 100 -c 100 -s 4 -h 0 -S 0 -L 0 -b 0"}
+
+rm -rf "$WORK"
+"$ROOT/bench/jobgen" -o "$WORK" $JOBGEN_ARGS
+
+echo "workload: $JOBGEN_ARGS"
+printf "%10s %8s %10s %10s %14s %12s %12s\n" interval threads wall_ms batches records_batch commit_p50 commit_p99
+for interval in $INTERVALS; do
+  for threads in $THREADS; do
+    rm -f "$WORK"/*.out "$WORK"/*.stats "$WORK"/*.wal
+    start=$(date +%s%N)
+    "$ROOT/ems-bench" --stats --wal="$interval" "$WORK" 1 "$threads" 0 >/dev/null 2>&1
+    end=$(date +%s%N)
+
+    cat "$WORK"/*.stats | awk -v wall=$(( (end - start) / 1000 )) -v interval="$interval" -v threads="$threads" '
+      $1 == "wal_batches" { batches += $2 }
+      $1 == "wal_records" { records += $2 }
+      $1 == "wal_commit_p50_us" && $2 > p50 { p50 = $2 }
+      $1 == "wal_commit_p99_us" && $2 > p99 { p99 = $2 }
+      END { printf "%10s %8s %10.1f %10d %14.2f %12.1f %12.1f\n", interval, threads, wall / 1e3, batches,
+            batches ? records / batches : 0, p50, p99 }'
+  done
+done
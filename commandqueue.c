@@ -0,0 +1,233 @@
+#include "commandqueue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ReserveBatch* reserve_batch_alloc(size_t num_requests) {
+  struct ReserveBatch* batch = malloc(sizeof(struct ReserveBatch));
+  if (!batch) return NULL;
+
+  batch->num_requests = num_requests;
+  batch->requests = calloc(num_requests, sizeof(struct ReserveRequest));
+  batch->results = calloc(num_requests, sizeof(int));
+  if (!batch->requests || !batch->results) {
+    free(batch->requests);
+    free(batch->results);
+    free(batch);
+    return NULL;
+  }
+  return batch;
+}
+
+int reserve_batch_set(struct ReserveBatch* batch, size_t index, size_t num_seats, const size_t* xs, const size_t* ys) {
+  struct ReserveRequest* request = &batch->requests[index];
+  // Rows and columns share one allocation
+  size_t* seats = malloc(2 * num_seats * sizeof(size_t));
+  if (!seats) return 1;
+
+  memcpy(seats, xs, num_seats * sizeof(size_t));
+  memcpy(seats + num_seats, ys, num_seats * sizeof(size_t));
+  request->num_seats = num_seats;
+  request->xs = seats;
+  request->ys = seats + num_seats;
+  return 0;
+}
+
+void reserve_batch_free(struct ReserveBatch* batch) {
+  if (!batch) return;
+  for (size_t i = 0; i < batch->num_requests; i++) free(batch->requests[i].xs);
+  free(batch->requests);
+  free(batch->results);
+  free(batch);
+}
+
+struct ShowParts* show_parts_alloc(unsigned int event_id, size_t num_parts) {
+  struct ShowParts* show = calloc(1, sizeof(struct ShowParts));
+  if (!show) return NULL;
+
+  if (pthread_mutex_init(&show->lock, NULL) != 0) {
+    free(show);
+    return NULL;
+  }
+  if (pthread_cond_init(&show->changed, NULL) != 0) {
+    pthread_mutex_destroy(&show->lock);
+    free(show);
+    return NULL;
+  }
+
+  show->state = SHOW_COPY_PENDING;
+  show->event_id = event_id;
+  show->num_parts = num_parts;
+  show->remaining = num_parts;
+  atomic_init(&show->nextRange, 0);
+  return show;
+}
+
+void show_parts_done(struct ShowParts* show) {
+  pthread_mutex_lock(&show->lock);
+  int last = --show->remaining == 0;
+  pthread_mutex_unlock(&show->lock);
+  if (!last) return;
+
+  pthread_cond_destroy(&show->changed);
+  pthread_mutex_destroy(&show->lock);
+  free(show->seats);
+  free(show);
+}
+
+int queue_init(struct CommandQueue* queue, size_t capacity) {
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) return 1;
+
+  queue->slots = malloc(capacity * sizeof(struct QueueSlot));
+  if (!queue->slots) return 1;
+
+  for (size_t i = 0; i < capacity; i++) {
+    atomic_init(&queue->slots[i].sequence, i);
+  }
+  queue->mask = capacity - 1;
+  atomic_init(&queue->pushPos, 0);
+  atomic_init(&queue->popPos, 0);
+  atomic_init(&queue->aborted, 0);
+
+  if (sem_init(&queue->items, 0, 0) != 0) {
+    free(queue->slots);
+    return 1;
+  }
+  if (sem_init(&queue->spaces, 0, (unsigned int)capacity) != 0) {
+    sem_destroy(&queue->items);
+    free(queue->slots);
+    return 1;
+  }
+  if (sem_init(&queue->fence, 0, 0) != 0) {
+    sem_destroy(&queue->spaces);
+    sem_destroy(&queue->items);
+    free(queue->slots);
+    return 1;
+  }
+
+  return 0;
+}
+
+void queue_destroy(struct CommandQueue* queue) {
+  sem_destroy(&queue->fence);
+  sem_destroy(&queue->spaces);
+  sem_destroy(&queue->items);
+  free(queue->slots);
+  queue->slots = NULL;
+}
+
+/// Waits on a semaphore of a queue, retrying when interrupted by a signal.
+/// @return 0 once the semaphore was taken, 1 if the wait failed or the queue was aborted.
+static int queue_wait(struct CommandQueue* queue, sem_t* sem) {
+  while (sem_wait(sem) != 0) {
+    if (errno != EINTR) return 1;
+  }
+  if (atomic_load(&queue->aborted)) {
+    // Passed on, so every thread waiting on it wakes up one after the other
+    sem_post(sem);
+    return 1;
+  }
+  return 0;
+}
+
+/// Takes a semaphore of a queue if it can be taken without waiting.
+/// @return 0 if the semaphore was taken, 1 if the queue failed or was aborted, 2 if it would have to wait.
+static int queue_try(struct CommandQueue* queue, sem_t* sem) {
+  while (sem_trywait(sem) != 0) {
+    if (errno == EAGAIN) return 2;
+    if (errno != EINTR) return 1;
+  }
+  if (atomic_load(&queue->aborted)) {
+    sem_post(sem);
+    return 1;
+  }
+  return 0;
+}
+
+/// Writes a record to the slot taken from spaces and announces it.
+/// @return 0 if the record was pushed, 1 otherwise.
+static int queue_insert(struct CommandQueue* queue, const struct CommandRecord* record) {
+  struct QueueSlot* slot;
+  size_t pos = atomic_load_explicit(&queue->pushPos, memory_order_relaxed);
+  while (1) {
+    slot = &queue->slots[pos & queue->mask];
+    size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+    if (sequence == pos) {
+      if (atomic_compare_exchange_weak_explicit(&queue->pushPos, &pos, pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else {
+      // Slot not released yet by a slower consumer, or another producer got it first
+      pos = atomic_load_explicit(&queue->pushPos, memory_order_relaxed);
+    }
+  }
+
+  memcpy(&slot->record, record, sizeof(struct CommandRecord));
+  atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+  if (sem_post(&queue->items) != 0) {
+    queue_abort(queue);
+    return 1;
+  }
+  return 0;
+}
+
+/// Reads the oldest record, from the slot taken from items, and hands its slot back.
+static void queue_take(struct CommandQueue* queue, struct CommandRecord* record) {
+  struct QueueSlot* slot;
+  size_t pos = atomic_load_explicit(&queue->popPos, memory_order_relaxed);
+  while (1) {
+    slot = &queue->slots[pos & queue->mask];
+    size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+    if (sequence == pos + 1) {
+      if (atomic_compare_exchange_weak_explicit(&queue->popPos, &pos, pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else {
+      // Record not published yet by a slower producer, or another consumer got it first
+      pos = atomic_load_explicit(&queue->popPos, memory_order_relaxed);
+    }
+  }
+
+  memcpy(record, &slot->record, sizeof(struct CommandRecord));
+  atomic_store_explicit(&slot->sequence, pos + queue->mask + 1, memory_order_release);
+
+  // The producer would wait forever for the slot
+  if (sem_post(&queue->spaces) != 0) queue_abort(queue);
+}
+
+int queue_push(struct CommandQueue* queue, const struct CommandRecord* record) {
+  if (queue_wait(queue, &queue->spaces) != 0) return 1;
+  return queue_insert(queue, record);
+}
+
+int queue_try_push(struct CommandQueue* queue, const struct CommandRecord* record) {
+  int result = queue_try(queue, &queue->spaces);
+  return result != 0 ? result : queue_insert(queue, record);
+}
+
+int queue_pop(struct CommandQueue* queue, struct CommandRecord* record) {
+  if (queue_wait(queue, &queue->items) != 0) return 1;
+  queue_take(queue, record);
+  return 0;
+}
+
+int queue_try_pop(struct CommandQueue* queue, struct CommandRecord* record) {
+  int result = queue_try(queue, &queue->items);
+  if (result == 0) queue_take(queue, record);
+  return result;
+}
+
+void queue_wait_fence(struct CommandQueue* queue) { queue_wait(queue, &queue->fence); }
+
+void queue_signal_fence(struct CommandQueue* queue) { sem_post(&queue->fence); }
+
+void queue_abort(struct CommandQueue* queue) {
+  atomic_store(&queue->aborted, 1);
+  sem_post(&queue->items);
+  sem_post(&queue->spaces);
+  sem_post(&queue->fence);
+}
@@ -0,0 +1,169 @@
+#ifndef COMMAND_QUEUE_H
+#define COMMAND_QUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+#include "constants.h"
+#include "parser.h"
+
+// One request of a RESERVE_BATCH, reserved all or nothing
+struct ReserveRequest {
+  size_t num_seats;  // 0 for a request whose line did not parse
+  size_t *xs;
+  size_t *ys;
+};
+
+// Requests of a RESERVE_BATCH, in the order they were read
+struct ReserveBatch {
+  size_t num_requests;
+  struct ReserveRequest *requests;
+  int *results;  // Result of each request, filled in when the batch is executed
+};
+
+struct Event;
+
+// Progress of the seat copy of a SHOW split in parts
+enum ShowCopyState {
+  SHOW_COPY_PENDING,  // No part ran yet
+  SHOW_COPY_LOCKING,  // The first part to run is locking the seats
+  SHOW_COPY_RUNNING,  // Seats held by that part, every part that runs meanwhile copies row ranges
+  SHOW_COPY_DONE,
+  SHOW_COPY_FAILED
+};
+
+// SHOW of a large event split by rows, each part is a record of its own rendered by whichever worker gets it.
+// The first part to run holds the seats while they are copied, so every part shows the event as of the same
+// point in time. The copy is split in the same row ranges, taken by whichever parts are running.
+struct ShowParts {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;  // Broadcast whenever state or copiers change
+  enum ShowCopyState state;
+  unsigned int event_id;
+  size_t num_parts;
+  size_t remaining;             // Parts not rendered yet, the last one frees the parts
+  struct Event *event;          // Event being copied, set once its seats are held
+  _Atomic unsigned int *data;   // Its seat array, NULL if it is sparse
+  _Atomic size_t nextRange;     // Next row range to copy
+  size_t copiers;               // Parts copying ranges besides the one holding the seats
+  size_t rows;
+  size_t cols;
+  size_t seatWidth;       // Widest seat id plus its separator
+  unsigned int *seats;    // Copy of the seats, rows * cols of them
+};
+
+// A fully parsed command, ready to be executed by a worker
+struct CommandRecord {
+  enum Command cmd;
+  unsigned int event_id;  // CREATE, RESERVE and SHOW
+  size_t num_rows;        // CREATE
+  size_t num_cols;        // CREATE
+  size_t num_coords;      // RESERVE, and the number of seats of RESERVE_BEST
+  size_t xs[MAX_RESERVATION_SIZE];
+  size_t ys[MAX_RESERVATION_SIZE];
+  unsigned int delay;      // WAIT
+  unsigned int thread_id;  // WAIT, 0 if no thread was specified
+  unsigned long seq;       // SHOW and LIST, position of the output in the .out file
+  char path[SNAPSHOT_PATH_MAX];  // SNAPSHOT
+  struct ReserveBatch *batch;    // RESERVE_BATCH, owned by the record until it is executed
+  struct ShowParts *show;        // SHOW split in parts, NULL if it is rendered by a single worker
+  size_t part;                   // SHOW, index of the part when split
+};
+
+struct QueueSlot {
+  _Atomic size_t sequence;  // Slot is writable when equal to the push position, readable one after it
+  struct CommandRecord record;
+};
+
+// Bounded multi-producer multi-consumer ring of command records.
+// The ring itself is lock-free, the semaphores only park threads when it is full or empty.
+struct CommandQueue {
+  struct QueueSlot* slots;
+  size_t mask;  // Capacity - 1
+  _Atomic size_t pushPos;
+  _Atomic size_t popPos;
+  sem_t items;   // Number of records ready to pop
+  sem_t spaces;  // Number of free slots
+  sem_t fence;   // Posted by a consumer once it has applied an ordering record
+  _Atomic int aborted;  // Set once the queue failed, every wait on it returns at once from then on
+};
+
+/// Allocates a batch of requests with no seats.
+/// @param num_requests Number of requests.
+/// @return The batch, NULL if it could not be allocated.
+struct ReserveBatch* reserve_batch_alloc(size_t num_requests);
+
+/// Sets the seats of a request of a batch, copying them.
+/// @param batch Batch the request belongs to.
+/// @param index Index of the request.
+/// @param num_seats Number of seats.
+/// @param xs Rows of the seats.
+/// @param ys Columns of the seats.
+/// @return 0 if the seats were set, 1 if they could not be allocated.
+int reserve_batch_set(struct ReserveBatch* batch, size_t index, size_t num_seats, const size_t* xs, const size_t* ys);
+
+/// Frees a batch of requests and their seats.
+/// @param batch Batch to free, may be NULL.
+void reserve_batch_free(struct ReserveBatch* batch);
+
+/// Allocates the shared state of a SHOW split in parts, with nothing copied yet.
+/// @param event_id Id of the event to show.
+/// @param num_parts Number of parts.
+/// @return The parts, NULL if they could not be allocated.
+struct ShowParts* show_parts_alloc(unsigned int event_id, size_t num_parts);
+
+/// Marks a part of a SHOW as rendered, freeing the shared state once every part is.
+/// @param show Parts of the SHOW.
+void show_parts_done(struct ShowParts* show);
+
+/// Initializes a command queue.
+/// @param queue Queue to initialize.
+/// @param capacity Number of slots, must be a power of two.
+/// @return 0 if the queue was initialized successfully, 1 otherwise.
+int queue_init(struct CommandQueue* queue, size_t capacity);
+
+/// Destroys a command queue.
+/// @param queue Queue to destroy.
+void queue_destroy(struct CommandQueue* queue);
+
+/// Pushes a copy of a record, waiting for a free slot if the queue is full.
+/// @note A record pushed that can not be announced to the consumers aborts the queue.
+/// @param queue Queue to push to.
+/// @param record Record to push.
+/// @return 0 if the record was pushed successfully, 1 otherwise or if the queue was aborted.
+int queue_push(struct CommandQueue* queue, const struct CommandRecord* record);
+
+/// Pops the oldest record, waiting for one if the queue is empty.
+/// @note A record popped whose slot can not be handed back to the producer is still returned, and aborts the queue.
+/// @param queue Queue to pop from.
+/// @param record Where to copy the record to.
+/// @return 0 if a record was popped, 1 if none was or if the queue was aborted.
+int queue_pop(struct CommandQueue* queue, struct CommandRecord* record);
+
+/// Pushes a copy of a record if the queue has a free slot.
+/// @param queue Queue to push to.
+/// @param record Record to push.
+/// @return 0 if the record was pushed, 1 if it could not be or the queue was aborted, 2 if the queue is full.
+int queue_try_push(struct CommandQueue* queue, const struct CommandRecord* record);
+
+/// Pops the oldest record if the queue has one.
+/// @param queue Queue to pop from.
+/// @param record Where to copy the record to.
+/// @return 0 if a record was popped, 1 if none could be or the queue was aborted, 2 if the queue is empty.
+int queue_try_pop(struct CommandQueue* queue, struct CommandRecord* record);
+
+/// Waits until a consumer signals that it applied an ordering record, or until the queue is aborted.
+/// @param queue Queue the ordering record was pushed to.
+void queue_wait_fence(struct CommandQueue* queue);
+
+/// Signals the producer that an ordering record was applied.
+/// @param queue Queue the ordering record was popped from.
+void queue_signal_fence(struct CommandQueue* queue);
+
+/// Fails a queue, waking every thread waiting on it. Pushes and pops fail from then on.
+/// @param queue Queue to abort.
+void queue_abort(struct CommandQueue* queue);
+
+#endif  // COMMAND_QUEUE_H
@@ -0,0 +1,307 @@
+#include "compiled.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "outbuffer.h"
+
+/// Parses the next command of a text job file into a compiled record.
+/// @param fd File descriptor of the text job file.
+/// @param record Where to store the command.
+/// @param coords Buffer the coordinates of a RESERVE are appended to.
+/// @param num_coords Number of coordinate pairs in coords, updated.
+/// @param failed Set to 1 if coords could not grow, EOC is returned then.
+/// @return The command, CMD_EMPTY for lines that compile to nothing.
+static enum Command compile_next(int fd, struct CompiledRecord *record, struct OutBuffer *coords,
+                                 uint64_t *num_coords, int *failed) {
+  memset(record, 0, sizeof(*record));
+  enum Command cmd = get_next(fd);
+  record->cmd = (uint32_t)cmd;
+
+  switch (cmd) {
+    case CMD_CREATE: {
+      size_t rows, cols;
+      if (parse_create(fd, &record->event_id, &rows, &cols) != 0) break;
+      record->a = (uint32_t)rows;
+      record->b = (uint32_t)cols;
+      return cmd;
+    }
+
+    case CMD_RESERVE: {
+      size_t xs[MAX_RESERVATION_SIZE], ys[MAX_RESERVATION_SIZE];
+      size_t count = parse_reserve(fd, MAX_RESERVATION_SIZE, &record->event_id, xs, ys);
+      if (count == 0) break;
+
+      record->a = (uint32_t)count;
+      record->coords = *num_coords;
+      for (size_t i = 0; i < count; i++) {
+        uint32_t pair[2] = {(uint32_t)xs[i], (uint32_t)ys[i]};
+        if (outbuf_put(coords, (const char *)pair, sizeof(pair)) != 0) {
+          *failed = 1;
+          return EOC;
+        }
+      }
+      *num_coords += count;
+      return cmd;
+    }
+
+    case CMD_RESERVE_BEST: {
+      size_t count;
+      if (parse_reserve_best(fd, &record->event_id, &count) != 0) break;
+      record->a = (uint32_t)count;
+      return cmd;
+    }
+
+    case CMD_RESERVE_BATCH: {
+      size_t count;
+      if (parse_reserve_batch(fd, &record->event_id, &count) != 0 || count == 0 || count > MAX_BATCH_REQUESTS) break;
+
+      record->a = (uint32_t)count;
+      record->coords = *num_coords;
+      // Requests that do not parse are kept with no seats, so they fail where the text run fails them
+      size_t xs[MAX_RESERVATION_SIZE], ys[MAX_RESERVATION_SIZE];
+      uint64_t pairs = 0;
+      for (size_t i = 0; i < count; i++) {
+        size_t num_seats = parse_seats(fd, MAX_RESERVATION_SIZE, xs, ys);
+        uint32_t head[2] = {(uint32_t)num_seats, 0};
+        if (outbuf_put(coords, (const char *)head, sizeof(head)) != 0) {
+          *failed = 1;
+          return EOC;
+        }
+        for (size_t j = 0; j < num_seats; j++) {
+          uint32_t pair[2] = {(uint32_t)xs[j], (uint32_t)ys[j]};
+          if (outbuf_put(coords, (const char *)pair, sizeof(pair)) != 0) {
+            *failed = 1;
+            return EOC;
+          }
+        }
+        pairs += 1 + num_seats;
+      }
+      record->b = (uint32_t)pairs;
+      *num_coords += pairs;
+      return cmd;
+    }
+
+    case CMD_SHOW:
+      if (parse_show(fd, &record->event_id) != 0) break;
+      return cmd;
+
+    case CMD_SNAPSHOT: {
+      char path[SNAPSHOT_PATH_MAX];
+      if (parse_snapshot(fd, path, sizeof(path)) != 0) break;
+
+      size_t len = strlen(path);
+      size_t pairs = (len + 2 * sizeof(uint32_t) - 1) / (2 * sizeof(uint32_t));
+      record->a = (uint32_t)len;
+      record->coords = *num_coords;
+      memset(path + len, 0, sizeof(path) - len);
+      if (outbuf_put(coords, path, pairs * 2 * sizeof(uint32_t)) != 0) {
+        *failed = 1;
+        return EOC;
+      }
+      *num_coords += pairs;
+      return cmd;
+    }
+
+    case CMD_WAIT: {
+      int hasThread = parse_wait(fd, &record->a, &record->b);
+      if (hasThread == -1) break;
+      if (hasThread == 0) record->b = 0;
+      return cmd;
+    }
+
+    case CMD_LIST_EVENTS:
+    case CMD_BARRIER:
+    case CMD_HELP:
+    case CMD_INVALID:
+    case CMD_EMPTY:
+    case EOC:
+      return cmd;
+  }
+
+  // Kept so that the replay reports it where the text run would
+  memset(record, 0, sizeof(*record));
+  record->cmd = CMD_INVALID;
+  return CMD_INVALID;
+}
+
+int compile_jobs(int fdin, int fdout) {
+  struct OutBuffer records, coords;
+  outbuf_init(&records);
+  outbuf_init(&coords);
+
+  struct CompiledHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, COMPILED_MAGIC, sizeof(header.magic));
+  header.version = COMPILED_VERSION;
+  header.record_size = sizeof(struct CompiledRecord);
+
+  int result = 0;
+  struct CompiledRecord record;
+  enum Command cmd;
+  while ((cmd = compile_next(fdin, &record, &coords, &header.num_coords, &result)) != EOC) {
+    if (cmd == CMD_EMPTY) continue;
+    if (outbuf_put(&records, (const char *)&record, sizeof(record)) != 0) {
+      result = 1;
+      break;
+    }
+    header.num_records++;
+  }
+
+  if (result == 0) {
+    result = write_all(fdout, (const char *)&header, sizeof(header)) || write_all(fdout, records.data, records.len) ||
+             write_all(fdout, coords.data, coords.len);
+  } else {
+    fprintf(stderr, "Error allocating memory for the compiled file\n");
+  }
+
+  outbuf_free(&records);
+  outbuf_free(&coords);
+  return result;
+}
+
+int compiled_open(int fd, struct CompiledJobs *jobs) {
+  struct CompiledHeader header;
+  ssize_t bytes = pread(fd, &header, sizeof(header), 0);
+  if (bytes < (ssize_t)sizeof(header.magic) || memcmp(header.magic, COMPILED_MAGIC, sizeof(header.magic)) != 0)
+    return 1;
+
+  struct stat st;
+  if (bytes != (ssize_t)sizeof(header) || header.version != COMPILED_VERSION ||
+      header.record_size != sizeof(struct CompiledRecord) || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Unsupported compiled job file\n");
+    return -1;
+  }
+
+  // The sizes in the header must add up to the file, so no record can point outside of it
+  size_t size = (size_t)st.st_size;
+  uint64_t records_size = header.num_records * sizeof(struct CompiledRecord);
+  uint64_t coords_size = header.num_coords * 2 * sizeof(uint32_t);
+  if (header.num_records > size / sizeof(struct CompiledRecord) || header.num_coords > size / (2 * sizeof(uint32_t)) ||
+      sizeof(header) + records_size + coords_size != size) {
+    fprintf(stderr, "Truncated compiled job file\n");
+    return -1;
+  }
+
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "mmap error: %s\n", strerror(errno));
+    return -1;
+  }
+  posix_madvise(mapping, size, POSIX_MADV_SEQUENTIAL);
+
+  jobs->mapping = mapping;
+  jobs->size = size;
+  jobs->records = (const struct CompiledRecord *)((const char *)mapping + sizeof(header));
+  jobs->coords = (const uint32_t *)((const char *)jobs->records + records_size);
+  jobs->num_records = header.num_records;
+  jobs->num_coords = header.num_coords;
+  jobs->next = 0;
+  return 0;
+}
+
+enum Command compiled_next(struct CompiledJobs *jobs, struct CommandRecord *record) {
+  if (jobs->next == jobs->num_records) {
+    record->cmd = EOC;
+    return EOC;
+  }
+
+  const struct CompiledRecord *compiled = &jobs->records[jobs->next++];
+  record->cmd = compiled->cmd <= EOC ? (enum Command)compiled->cmd : CMD_INVALID;
+  record->event_id = compiled->event_id;
+
+  switch (record->cmd) {
+    case CMD_CREATE:
+      record->num_rows = compiled->a;
+      record->num_cols = compiled->b;
+      break;
+
+    case CMD_RESERVE:
+      if (compiled->a == 0 || compiled->a >= MAX_RESERVATION_SIZE || compiled->coords > jobs->num_coords ||
+          compiled->a > jobs->num_coords - compiled->coords) {
+        record->cmd = CMD_INVALID;
+        break;
+      }
+      record->num_coords = compiled->a;
+      for (size_t i = 0; i < compiled->a; i++) {
+        record->xs[i] = jobs->coords[2 * (compiled->coords + i)];
+        record->ys[i] = jobs->coords[2 * (compiled->coords + i) + 1];
+      }
+      break;
+
+    case CMD_RESERVE_BEST:
+      record->num_coords = compiled->a;
+      break;
+
+    case CMD_RESERVE_BATCH: {
+      if (compiled->a == 0 || compiled->a > MAX_BATCH_REQUESTS || compiled->coords > jobs->num_coords ||
+          compiled->b > jobs->num_coords - compiled->coords || (record->batch = reserve_batch_alloc(compiled->a)) == NULL) {
+        record->cmd = CMD_INVALID;
+        break;
+      }
+
+      const uint32_t *pair = &jobs->coords[2 * compiled->coords];
+      const uint32_t *end = pair + 2 * (size_t)compiled->b;
+      for (size_t i = 0; i < compiled->a && record->cmd != CMD_INVALID; i++) {
+        size_t num_seats = pair < end ? pair[0] : MAX_RESERVATION_SIZE;
+        if (num_seats >= MAX_RESERVATION_SIZE || (size_t)(end - pair) / 2 < 1 + num_seats) {
+          record->cmd = CMD_INVALID;
+          break;
+        }
+        for (size_t j = 0; j < num_seats; j++) {
+          record->xs[j] = pair[2 * (j + 1)];
+          record->ys[j] = pair[2 * (j + 1) + 1];
+        }
+        if (num_seats > 0 && reserve_batch_set(record->batch, i, num_seats, record->xs, record->ys) != 0)
+          record->cmd = CMD_INVALID;
+        pair += 2 * (1 + num_seats);
+      }
+
+      if (record->cmd == CMD_INVALID) {
+        reserve_batch_free(record->batch);
+        record->batch = NULL;
+      }
+      break;
+    }
+
+    case CMD_SNAPSHOT: {
+      size_t pairs = ((size_t)compiled->a + 2 * sizeof(uint32_t) - 1) / (2 * sizeof(uint32_t));
+      if (compiled->a == 0 || compiled->a >= SNAPSHOT_PATH_MAX || compiled->coords > jobs->num_coords ||
+          pairs > jobs->num_coords - compiled->coords) {
+        record->cmd = CMD_INVALID;
+        break;
+      }
+      memcpy(record->path, &jobs->coords[2 * compiled->coords], compiled->a);
+      record->path[compiled->a] = '\0';
+      break;
+    }
+
+    case CMD_WAIT:
+      record->delay = compiled->a;
+      record->thread_id = compiled->b;
+      break;
+
+    case CMD_SHOW:
+    case CMD_LIST_EVENTS:
+    case CMD_BARRIER:
+    case CMD_HELP:
+    case CMD_INVALID:
+    case CMD_EMPTY:
+    case EOC:
+      break;
+  }
+
+  // An EOC record would end the file early, the real end is after the last record
+  if (record->cmd == EOC || record->cmd == CMD_EMPTY) record->cmd = CMD_INVALID;
+  return record->cmd;
+}
+
+void compiled_close(struct CompiledJobs *jobs) {
+  if (jobs->mapping != NULL) munmap(jobs->mapping, jobs->size);
+  jobs->mapping = NULL;
+}
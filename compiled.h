@@ -0,0 +1,67 @@
+#ifndef COMPILED_H
+#define COMPILED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "commandqueue.h"
+#include "parser.h"
+
+#define COMPILED_MAGIC "EMSBIN01"  // First bytes of a compiled job file
+#define COMPILED_VERSION 2
+
+// Compiled job file: this header, the records, then the coordinates of every RESERVE as (row, col) pairs.
+// The path of a SNAPSHOT is stored among the coordinates too, padded to a whole number of pairs.
+// Each request of a RESERVE_BATCH is a (number of seats, 0) pair followed by its seats.
+// Numbers are in the byte order of the machine that compiled the file.
+struct CompiledHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;  // sizeof(struct CompiledRecord), to reject files of another layout
+  uint64_t num_records;
+  uint64_t num_coords;   // Number of coordinate pairs
+};
+
+struct CompiledRecord {
+  uint32_t cmd;       // enum Command, CMD_INVALID for lines that did not parse
+  uint32_t event_id;  // CREATE, RESERVE, RESERVE_BEST and SHOW
+  uint32_t a;         // Rows of CREATE, seats of RESERVE and RESERVE_BEST, delay of WAIT, length of SNAPSHOT path,
+                      // requests of RESERVE_BATCH
+  uint32_t b;         // Columns of CREATE, thread of WAIT, coordinate pairs of RESERVE_BATCH
+  uint64_t coords;    // RESERVE, RESERVE_BATCH and SNAPSHOT, index of the first coordinate pair
+};
+
+// A compiled job file mapped for replay
+struct CompiledJobs {
+  void *mapping;
+  size_t size;
+  const struct CompiledRecord *records;
+  const uint32_t *coords;
+  uint64_t num_records;
+  uint64_t num_coords;
+  uint64_t next;  // Index of the next record to replay
+};
+
+/// Compiles a text job file.
+/// @param fdin File descriptor of the text job file.
+/// @param fdout File descriptor to write the compiled file to.
+/// @return 0 if the file was compiled, 1 otherwise.
+int compile_jobs(int fdin, int fdout);
+
+/// Maps a job file for replay if it is compiled.
+/// @param fd File descriptor of the job file, at its start.
+/// @param jobs Where to store the mapped file.
+/// @return 0 if the file is compiled and was mapped, 1 if it is a text file, -1 if it is a broken compiled file.
+int compiled_open(int fd, struct CompiledJobs *jobs);
+
+/// Gets the next command of a compiled file.
+/// @param jobs Compiled file to replay.
+/// @param record Where to store the command.
+/// @return The command, EOC after the last one.
+enum Command compiled_next(struct CompiledJobs *jobs, struct CommandRecord *record);
+
+/// Unmaps a compiled file.
+/// @param jobs Compiled file to unmap.
+void compiled_close(struct CompiledJobs *jobs);
+
+#endif  // COMPILED_H
@@ -1,2 +1,13 @@
 #define MAX_RESERVATION_SIZE 256
+#define MAX_BATCH_REQUESTS 4096  // Most requests a RESERVE_BATCH takes
 #define STATE_ACCESS_DELAY_MS 10
+#define COMMAND_QUEUE_SIZE 64  // Parsed commands buffered ahead of the workers (power of two)
+#define SHOW_PART_SEATS 65536  // Seats per part of a SHOW at least, larger events are rendered by several workers
+#define LIST_CHUNK_SIZE 65536  // LIST writes its output in chunks of about this many bytes
+#define STATE_PAGE_SEATS 1024  // Seats fetched by one simulated state access
+#define EVENT_CACHE_SIZE 64  // Events remembered by each thread, by id modulo this size
+#define OUTPUT_COMMIT_SIZE 65536  // Output held in order before it is written to the .out file
+#define OUTPUT_COMMIT_IOVS 64  // Most command outputs written by a single writev
+#define SNAPSHOT_PATH_MAX 256  // Longest path a SNAPSHOT command accepts
+#define WAL_FLUSH_BYTES 65536  // Batch size at which the reservation log is written without waiting longer
+#define WAL_FLUSH_INTERVAL_US 200  // Default time a batch of the reservation log waits for more records
@@ -1,16 +1,146 @@
 #include "eventlist.h"
 
+#include <fcntl.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/// Mixes the bits of an event id so that sequential ids spread over the buckets.
+/// @param event_id Event id.
+/// @return Hash of the id.
+static size_t hash_id(unsigned int event_id) {
+  unsigned int h = event_id;
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return (size_t)h;
+}
+
+/// Allocates zero filled memory from an arena.
+/// @param arena Arena to allocate from.
+/// @param size Number of bytes.
+/// @return Memory aligned for any type, NULL on failure.
+static void* arena_alloc(struct EventArena* arena, size_t size) {
+  size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+
+  pthread_mutex_lock(&arena->lock);
+  struct ArenaChunk* chunk = arena->chunks;
+  if (!chunk || chunk->size - chunk->used < size) {
+    size_t chunk_size = size > EVENT_ARENA_CHUNK ? size : EVENT_ARENA_CHUNK;
+    chunk = calloc(1, sizeof(struct ArenaChunk) + chunk_size);
+    if (!chunk) {
+      pthread_mutex_unlock(&arena->lock);
+      return NULL;
+    }
+    chunk->size = chunk_size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+
+  void* memory = (char*)chunk->data + chunk->used;
+  chunk->used += size;
+  pthread_mutex_unlock(&arena->lock);
+  return memory;
+}
+
+/// Maps zero filled memory whose pages are only allocated once they are written.
+/// @param size Number of bytes.
+/// @return The mapping, NULL on failure.
+static void* map_zeroed(size_t size) {
+  int fd = open("/dev/zero", O_RDWR);
+  if (fd < 0) return NULL;
+  void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return memory == MAP_FAILED ? NULL : memory;
+}
+
+static pthread_rwlock_t* stripe_lock(struct EventList* list, size_t bucket) {
+  return &list->stripeLocks[bucket & (EVENT_INDEX_STRIPES - 1)];
+}
 
 struct EventList* create_list() {
   struct EventList* list = (struct EventList*)malloc(sizeof(struct EventList));
   if (!list) return NULL;
-  list->head = NULL;
-  list->tail = NULL;
+  atomic_init(&list->head, NULL);
+  atomic_init(&list->tail, NULL);
+
+  list->num_buckets = EVENT_INDEX_INITIAL_BUCKETS;
+  list->buckets = calloc(list->num_buckets, sizeof(struct ListNode*));
+  if (!list->buckets) {
+    free(list);
+    return NULL;
+  }
+  atomic_store(&list->size, 0);
+
+  // Locks initialized so far are destroyed if a later one fails
+  size_t stripes = 0;
+  int failed = pthread_mutex_init(&list->listLock, NULL) != 0;
+  if (!failed && pthread_rwlock_init(&list->resizeLock, NULL) != 0) {
+    pthread_mutex_destroy(&list->listLock);
+    failed = 1;
+  }
+  while (!failed && stripes < EVENT_INDEX_STRIPES && pthread_rwlock_init(&list->stripeLocks[stripes], NULL) == 0)
+    stripes++;
+
+  list->snapshot = NULL;
+  list->snapshot_size = 0;
+  list->arena.chunks = NULL;
+  if (!failed && (stripes < EVENT_INDEX_STRIPES || pthread_mutex_init(&list->arena.lock, NULL) != 0)) {
+    for (size_t i = 0; i < stripes; i++) pthread_rwlock_destroy(&list->stripeLocks[i]);
+    pthread_rwlock_destroy(&list->resizeLock);
+    pthread_mutex_destroy(&list->listLock);
+    failed = 1;
+  }
+
+  if (failed) {
+    free(list->buckets);
+    free(list);
+    return NULL;
+  }
   return list;
 }
 
+/// Doubles the number of buckets of the index if it is over its load factor.
+/// @param list Event list to be resized.
+static void resize_index(struct EventList* list) {
+  if (pthread_rwlock_wrlock(&list->resizeLock) != 0) return;
+
+  // Another thread may have resized while we waited for the lock
+  if (atomic_load(&list->size) <= list->num_buckets) {
+    pthread_rwlock_unlock(&list->resizeLock);
+    return;
+  }
+
+  size_t num_buckets = list->num_buckets * 2;
+  struct ListNode** buckets = calloc(num_buckets, sizeof(struct ListNode*));
+  if (!buckets) {
+    // Keep the old index, lookups just get slower
+    pthread_rwlock_unlock(&list->resizeLock);
+    return;
+  }
+
+  for (size_t i = 0; i < list->num_buckets; i++) {
+    struct ListNode* current = list->buckets[i];
+    while (current) {
+      struct ListNode* next = current->chain;
+      size_t bucket = hash_id(current->event->id) & (num_buckets - 1);
+      current->chain = buckets[bucket];
+      buckets[bucket] = current;
+      current = next;
+    }
+  }
+
+  free(list->buckets);
+  list->buckets = buckets;
+  list->num_buckets = num_buckets;
+
+  pthread_rwlock_unlock(&list->resizeLock);
+}
+
 int append_to_list(struct EventList* list, struct Event* event) {
   if (!list) return 1;
 
@@ -18,52 +148,308 @@ int append_to_list(struct EventList* list, struct Event* event) {
   if (!new_node) return 1;
 
   new_node->event = event;
-  new_node->next = NULL;
+  atomic_init(&new_node->next, NULL);
+
+  if (pthread_rwlock_rdlock(&list->resizeLock) != 0) {
+    free(new_node);
+    return 1;
+  }
+
+  size_t bucket = hash_id(event->id) & (list->num_buckets - 1);
+  pthread_rwlock_t* lock = stripe_lock(list, bucket);
+  if (pthread_rwlock_wrlock(lock) != 0) {
+    pthread_rwlock_unlock(&list->resizeLock);
+    free(new_node);
+    return 1;
+  }
+
+  for (struct ListNode* current = list->buckets[bucket]; current; current = current->chain) {
+    if (current->event->id == event->id) {
+      pthread_rwlock_unlock(lock);
+      pthread_rwlock_unlock(&list->resizeLock);
+      free(new_node);
+      return 2;
+    }
+  }
+
+  new_node->chain = list->buckets[bucket];
+  list->buckets[bucket] = new_node;
+  size_t size = atomic_fetch_add(&list->size, 1) + 1;
+  size_t num_buckets = list->num_buckets;
 
-  if (list->head == NULL) {
-    list->head = new_node;
-    list->tail = new_node;
+  pthread_rwlock_unlock(lock);
+  pthread_rwlock_unlock(&list->resizeLock);
+
+  // The node is linked before it becomes the tail, so a reader that sees the new tail can also reach it
+  pthread_mutex_lock(&list->listLock);
+  struct ListNode* tail = atomic_load_explicit(&list->tail, memory_order_relaxed);
+  if (tail == NULL) {
+    atomic_store_explicit(&list->head, new_node, memory_order_release);
   } else {
-    list->tail->next = new_node;
-    list->tail = new_node;
+    atomic_store_explicit(&tail->next, new_node, memory_order_release);
+  }
+  atomic_store_explicit(&list->tail, new_node, memory_order_release);
+  pthread_mutex_unlock(&list->listLock);
+
+  if (size > num_buckets) {
+    resize_index(list);
   }
 
   return 0;
 }
 
-static void free_event(struct Event* event) {
+size_t event_seats_size(size_t num_rows, size_t num_cols) {
+  size_t data_size = (num_rows * num_cols * sizeof(_Atomic unsigned int) + 7) / 8 * 8;
+  return data_size + num_rows * ((num_cols + 63) / 64) * sizeof(_Atomic uint64_t);
+}
+
+struct Event* create_event(struct EventList* list, unsigned int event_id, size_t num_rows, size_t num_cols) {
+  return create_event_at(list, event_id, num_rows, num_cols, NULL);
+}
+
+struct Event* create_event_at(struct EventList* list, unsigned int event_id, size_t num_rows, size_t num_cols,
+                              void* seats) {
+  size_t num_locks = num_rows < SEAT_LOCK_STRIPES ? num_rows : SEAT_LOCK_STRIPES;
+  struct Event* event = arena_alloc(&list->arena, sizeof(struct Event) + num_locks * sizeof(pthread_rwlock_t) +
+                                                      num_locks * sizeof(_Atomic unsigned char));
+  if (!event) return NULL;
+
+  event->id = event_id;
+  event->rows = num_rows;
+  event->cols = num_cols;
+  atomic_store(&event->reservations, 0);
+
+  // Seat locks and their states are left zero, so SEAT_LOCK_UNINITIALIZED
+  event->num_locks = num_locks;
+  event->seatLocks = (pthread_rwlock_t*)(event + 1);
+  event->lockState = (_Atomic unsigned char*)(event->seatLocks + num_locks);
+
+  event->row_words = (num_cols + 63) / 64;
+  size_t data_size = (num_rows * num_cols * sizeof(_Atomic unsigned int) + 7) / 8 * 8;
+  size_t size = event_seats_size(num_rows, num_cols);
+
+  // Large venues get pages that are only zeroed by the kernel once a seat in them is touched
+  event->mapping = NULL;
+  event->mapping_size = 0;
+  event->chunks = NULL;
+  event->num_chunks = 0;
+  event->dense = NULL;
+  event->dense_size = 0;
+  atomic_init(&event->sparse, 0);
+  atomic_init(&event->chunks_used, 0);
+  int sparse = seats == NULL && num_rows * num_cols >= EVENT_SPARSE_SEATS;
+
+  if (sparse) {
+    // Only the bitmap is mapped, the seats come in chunks as they are claimed
+    event->num_chunks = (num_rows * num_cols + EVENT_CHUNK_SEATS - 1) / EVENT_CHUNK_SEATS;
+    event->mapping_size = size - data_size;
+    event->mapping = map_zeroed(event->mapping_size);
+    event->chunks = calloc(event->num_chunks, sizeof(*event->chunks));
+    if (!event->mapping || !event->chunks || pthread_rwlock_init(&event->layoutLock, NULL) != 0) {
+      if (event->mapping) munmap(event->mapping, event->mapping_size);
+      free(event->chunks);
+      return NULL;
+    }
+    atomic_init(&event->sparse, 1);
+  } else if (seats != NULL || size == 0) {
+    // Seats owned by someone else, such as a snapshot mapping
+  } else if (size >= EVENT_MAPPING_THRESHOLD) {
+    seats = map_zeroed(size);
+    if (!seats) return NULL;
+    event->mapping = seats;
+    event->mapping_size = size;
+  } else {
+    seats = arena_alloc(&list->arena, size);
+    if (!seats) return NULL;
+  }
+
+  event->data = sparse ? NULL : seats;
+  event->occupied = sparse ? event->mapping : seats ? (_Atomic uint64_t*)((char*)seats + data_size) : NULL;
+
+  atomic_init(&event->freeRuns, NULL);
+  if (pthread_mutex_init(&event->freeRunLock, NULL) != 0) {
+    if (event->mapping) munmap(event->mapping, event->mapping_size);
+    if (sparse) {
+      free(event->chunks);
+      pthread_rwlock_destroy(&event->layoutLock);
+    }
+    return NULL;
+  }
+  return event;
+}
+
+_Atomic unsigned int* event_seats_begin(struct Event* event) {
+  // Events never go back to sparse, a dense one needs no lock
+  if (!atomic_load_explicit(&event->sparse, memory_order_acquire)) return event->data;
+
+  pthread_rwlock_rdlock(&event->layoutLock);
+  if (atomic_load_explicit(&event->sparse, memory_order_relaxed)) return NULL;
+
+  // Turned dense while this thread waited for the lock
+  pthread_rwlock_unlock(&event->layoutLock);
+  return event->data;
+}
+
+void event_seats_end(struct Event* event) {
+  // Still sparse only if event_seats_begin kept the lock, nothing turns it dense while the lock is held
+  if (atomic_load_explicit(&event->sparse, memory_order_relaxed)) pthread_rwlock_unlock(&event->layoutLock);
+}
+
+_Atomic unsigned int* event_sparse_seat(struct Event* event, size_t index, int create) {
+  _Atomic unsigned int* _Atomic* slot = &event->chunks[index / EVENT_CHUNK_SEATS];
+  _Atomic unsigned int* chunk = atomic_load_explicit(slot, memory_order_acquire);
+
+  if (!chunk) {
+    if (!create) return NULL;
+
+    _Atomic unsigned int* fresh = calloc(EVENT_CHUNK_SEATS, sizeof(_Atomic unsigned int));
+    if (!fresh) return NULL;
+    if (atomic_compare_exchange_strong_explicit(slot, &chunk, fresh, memory_order_acq_rel, memory_order_acquire)) {
+      chunk = fresh;
+      atomic_fetch_add_explicit(&event->chunks_used, 1, memory_order_relaxed);
+    } else {
+      // Another thread allocated it first, chunk now holds theirs
+      free(fresh);
+    }
+  }
+
+  return &chunk[index % EVENT_CHUNK_SEATS];
+}
+
+void event_densify(struct Event* event) {
+  if (!atomic_load_explicit(&event->sparse, memory_order_acquire) ||
+      atomic_load_explicit(&event->chunks_used, memory_order_relaxed) * EVENT_DENSE_DIVISOR < event->num_chunks)
+    return;
+
+  pthread_rwlock_wrlock(&event->layoutLock);
+  if (atomic_load_explicit(&event->sparse, memory_order_relaxed)) {
+    size_t num_seats = event->rows * event->cols;
+    size_t size = num_seats * sizeof(_Atomic unsigned int);
+    _Atomic unsigned int* data = map_zeroed(size);
+
+    // Stays sparse if there is no memory for the array, the next reservation tries again
+    if (data) {
+      for (size_t i = 0; i < event->num_chunks; i++) {
+        _Atomic unsigned int* chunk = atomic_load_explicit(&event->chunks[i], memory_order_relaxed);
+        if (!chunk) continue;
+
+        size_t first = i * EVENT_CHUNK_SEATS;
+        size_t count = num_seats - first < EVENT_CHUNK_SEATS ? num_seats - first : EVENT_CHUNK_SEATS;
+        for (size_t j = 0; j < count; j++)
+          atomic_store_explicit(&data[first + j], atomic_load_explicit(&chunk[j], memory_order_relaxed),
+                                memory_order_relaxed);
+        free(chunk);
+        atomic_store_explicit(&event->chunks[i], NULL, memory_order_relaxed);
+      }
+
+      event->data = data;
+      event->dense = data;
+      event->dense_size = size;
+      atomic_store_explicit(&event->sparse, 0, memory_order_release);
+    }
+  }
+  pthread_rwlock_unlock(&event->layoutLock);
+}
+
+pthread_rwlock_t* event_seat_lock(struct Event* event, size_t lock) {
+  _Atomic unsigned char* state = &event->lockState[lock];
+  unsigned char current = atomic_load_explicit(state, memory_order_acquire);
+
+  while (current != SEAT_LOCK_READY) {
+    if (current == SEAT_LOCK_UNINITIALIZED &&
+        atomic_compare_exchange_strong(state, &current, (unsigned char)SEAT_LOCK_INITIALIZING)) {
+      if (pthread_rwlock_init(&event->seatLocks[lock], NULL) != 0) {
+        atomic_store(state, (unsigned char)SEAT_LOCK_UNINITIALIZED);
+        return NULL;
+      }
+      atomic_store_explicit(state, (unsigned char)SEAT_LOCK_READY, memory_order_release);
+      break;
+    }
+
+    // Another thread is initializing it, which takes no time
+    sched_yield();
+    current = atomic_load_explicit(state, memory_order_acquire);
+  }
+
+  return &event->seatLocks[lock];
+}
+
+void free_event(struct Event* event) {
   if (!event) return;
 
-  free(event->data);
-  free(event);
+  for (size_t i = 0; i < event->num_locks; i++) {
+    if (atomic_load(&event->lockState[i]) == SEAT_LOCK_READY) pthread_rwlock_destroy(&event->seatLocks[i]);
+  }
+  if (event->mapping) munmap(event->mapping, event->mapping_size);
+  if (event->num_chunks > 0) {
+    for (size_t i = 0; i < event->num_chunks; i++) free(atomic_load(&event->chunks[i]));
+    free(event->chunks);
+    pthread_rwlock_destroy(&event->layoutLock);
+  }
+  if (event->dense) munmap(event->dense, event->dense_size);
+  freerun_free(atomic_load(&event->freeRuns));
+  pthread_mutex_destroy(&event->freeRunLock);
 }
 
 void free_list(struct EventList* list) {
   if (!list) return;
 
-  struct ListNode* current = list->head;
+  struct ListNode* current = atomic_load(&list->head);
   while (current) {
     struct ListNode* temp = current;
-    current = current->next;
+    current = atomic_load(&current->next);
 
     free_event(temp->event);
     free(temp);
   }
 
+  while (list->arena.chunks) {
+    struct ArenaChunk* chunk = list->arena.chunks;
+    list->arena.chunks = chunk->next;
+    free(chunk);
+  }
+  pthread_mutex_destroy(&list->arena.lock);
+  if (list->snapshot) munmap(list->snapshot, list->snapshot_size);
+
+  for (size_t i = 0; i < EVENT_INDEX_STRIPES; i++) {
+    pthread_rwlock_destroy(&list->stripeLocks[i]);
+  }
+  pthread_rwlock_destroy(&list->resizeLock);
+  pthread_mutex_destroy(&list->listLock);
+  free(list->buckets);
   free(list);
 }
 
+void list_snapshot(struct EventList* list, struct ListNode** first, struct ListNode** last) {
+  // Tail first: every node up to it is already linked from the head
+  *last = atomic_load_explicit(&list->tail, memory_order_acquire);
+  *first = *last == NULL ? NULL : atomic_load_explicit(&list->head, memory_order_acquire);
+}
+
+struct ListNode* list_next(struct ListNode* node) { return atomic_load_explicit(&node->next, memory_order_acquire); }
+
 struct Event* get_event(struct EventList* list, unsigned int event_id) {
   if (!list) return NULL;
 
-  struct ListNode* current = list->head;
-  while (current) {
-    struct Event* event = current->event;
-    if (event->id == event_id) {
-      return event;
+  if (pthread_rwlock_rdlock(&list->resizeLock) != 0) return NULL;
+
+  size_t bucket = hash_id(event_id) & (list->num_buckets - 1);
+  pthread_rwlock_t* lock = stripe_lock(list, bucket);
+  if (pthread_rwlock_rdlock(lock) != 0) {
+    pthread_rwlock_unlock(&list->resizeLock);
+    return NULL;
+  }
+
+  struct Event* event = NULL;
+  for (struct ListNode* current = list->buckets[bucket]; current; current = current->chain) {
+    if (current->event->id == event_id) {
+      event = current->event;
+      break;
     }
-    current = current->next;
   }
 
-  return NULL;
+  pthread_rwlock_unlock(lock);
+  pthread_rwlock_unlock(&list->resizeLock);
+
+  return event;
 }
@@ -4,11 +4,23 @@
 #include <stddef.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stdint.h>
 
-typedef struct data {
-  unsigned int value;
-  pthread_rwlock_t seatLock;
-} Data;
+#include "freerun.h"
+
+#define EVENT_INDEX_STRIPES 64         // Number of locks guarding the index buckets (power of two)
+#define EVENT_INDEX_INITIAL_BUCKETS 64  // Initial number of buckets (power of two, >= stripes)
+
+#define SEAT_LOCK_STRIPES 64  // Maximum number of seat locks per event, at most 64 so a set of them fits a mask
+
+#define EVENT_ARENA_CHUNK 65536      // Bytes the event arena takes from malloc at a time
+#define EVENT_MAPPING_THRESHOLD 65536  // Seat arrays of at least this many bytes are mapped from /dev/zero
+#define EVENT_SPARSE_SEATS 1048576  // Events with at least this many seats start sparse
+#define EVENT_CHUNK_SEATS 64        // Seats a sparse event allocates at a time, when the first of them is claimed
+#define EVENT_DENSE_DIVISOR 8       // A sparse event turns dense once 1/EVENT_DENSE_DIVISOR of its chunks exist
+
+// States of a seat lock, which is only initialized when first used
+enum SeatLockState { SEAT_LOCK_UNINITIALIZED, SEAT_LOCK_INITIALIZING, SEAT_LOCK_READY };
 
 struct Event {
   unsigned int id;            /// Event id
@@ -17,18 +29,67 @@ struct Event {
   size_t cols;  /// Number of columns.
   size_t rows;  /// Number of rows.
 
-  Data *data;  /// Array of size rows * cols with the reservations for each seat.
+  _Atomic unsigned int *data;  /// Array of size rows * cols with the reservations for each seat, NULL while sparse.
+
+  _Atomic uint64_t *occupied;  /// Bitmap with one bit per taken seat, each row starts on a new word.
+  size_t row_words;            /// Number of bitmap words per row.
+
+  size_t num_locks;              /// Number of seat locks, min(rows, SEAT_LOCK_STRIPES).
+  pthread_rwlock_t *seatLocks;   /// Seats in row r are guarded by seatLocks[(r - 1) % num_locks].
+  _Atomic unsigned char *lockState;  /// SeatLockState of each seat lock, get them through event_seat_lock.
+
+  void *mapping;        /// Mapping holding data and occupied, only occupied if sparse. NULL if from the arena.
+  size_t mapping_size;  /// Size of the mapping.
+
+  // Sparse events keep their seats in chunks of EVENT_CHUNK_SEATS, allocated when a seat in them is claimed,
+  // until enough of them exist that a dense array takes less memory. A chunk that does not exist is all free.
+  _Atomic int sparse;                     /// 1 while the seats are in chunks.
+  _Atomic unsigned int *_Atomic *chunks;  /// Chunk of each group of EVENT_CHUNK_SEATS seats, NULL if not allocated.
+  size_t num_chunks;                      /// Number of entries in chunks.
+  _Atomic size_t chunks_used;             /// Number of chunks allocated.
+  pthread_rwlock_t layoutLock;            /// Held for reading while the seats are used, for writing to turn dense.
+  void *dense;                            /// Mapping of data once a sparse event turned dense, NULL otherwise.
+  size_t dense_size;                      /// Size of that mapping.
+
+  pthread_mutex_t freeRunLock;               /// Lock for building, searching and updating freeRuns.
+  struct FreeRunIndex *_Atomic freeRuns;     /// Runs of free seats, NULL until the first RESERVE_BEST.
+};
+
+struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t used;  // Bytes handed out
+  size_t size;  // Bytes of data
+  max_align_t data[];
+};
+
+// Bump allocator for the events of a list, zero filled and only freed with the list
+struct EventArena {
+  pthread_mutex_t lock;
+  struct ArenaChunk *chunks;  // Chunk being filled first
 };
 
 struct ListNode {
   struct Event* event;
-  struct ListNode* next;
+  struct ListNode* _Atomic next;  // Next node in creation order, published with release semantics
+  struct ListNode* chain;         // Next node in the same index bucket
 };
 
-// Linked list structure
+// Append-only linked list structure, indexed by event id.
+// Nodes are never removed before free_list, so readers walk it without locks.
 struct EventList {
-  struct ListNode* head;  // Head of the list
-  struct ListNode* tail;  // Tail of the list
+  struct ListNode* _Atomic head;  // Head of the list
+  struct ListNode* _Atomic tail;  // Tail of the list
+  pthread_mutex_t listLock;       // Lock for appending to the list
+
+  struct ListNode** buckets;  // Hash index of the nodes, keyed by event id
+  size_t num_buckets;         // Number of buckets (power of two)
+  _Atomic size_t size;        // Number of events in the index
+  pthread_rwlock_t resizeLock;  // Held for writing while the index is resized
+  pthread_rwlock_t stripeLocks[EVENT_INDEX_STRIPES];  // Lock of bucket i is i % EVENT_INDEX_STRIPES
+
+  struct EventArena arena;  // Memory of the events in the list
+  void* snapshot;           // Mapping of the snapshot the list was loaded from, NULL if none
+  size_t snapshot_size;     // Size of that mapping
 };
 
 /// Creates a new event list.
@@ -36,17 +97,94 @@ struct EventList {
 struct EventList* create_list();
 
 /// Appends a new node to the list.
+/// @note Safe to call concurrently with other appends and lookups.
 /// @param list Event list to be modified.
 /// @param data Event to be stored in the new node.
-/// @return 0 if the node was appended successfully, 1 otherwise.
+/// @return 0 if the node was appended successfully, 2 if an event with the same id is already in the list,
+/// 1 otherwise.
 int append_to_list(struct EventList* list, struct Event* data);
 
+/// Gets the first and last nodes of the list as of now.
+/// @note Every node from first up to last can be walked with list_next without locks, even while events are
+/// appended, and it will always be the same nodes.
+/// @param list Event list to be walked.
+/// @param first Where to store the first node, NULL if the list is empty.
+/// @param last Where to store the last node, NULL if the list is empty.
+void list_snapshot(struct EventList* list, struct ListNode** first, struct ListNode** last);
+
+/// Gets the node after the given one.
+/// @param node Node of the list.
+/// @return Next node in creation order, NULL if there is none yet.
+struct ListNode* list_next(struct ListNode* node);
+
+/// Allocates an event with all its seats free, to be added to the given list.
+/// @note Takes constant time whatever the size of the venue, seat memory is only touched once it is used.
+/// Events of at least EVENT_SPARSE_SEATS seats start sparse, so their memory follows the seats reserved.
+/// @param list Event list whose arena the event is allocated from.
+/// @param event_id Event id.
+/// @param num_rows Number of rows.
+/// @param num_cols Number of columns.
+/// @return Newly created event, NULL on failure.
+struct Event* create_event(struct EventList* list, unsigned int event_id, size_t num_rows, size_t num_cols);
+
+/// Allocates an event whose seats live in memory owned by someone else.
+/// @param list Event list whose arena the event is allocated from.
+/// @param event_id Event id.
+/// @param num_rows Number of rows.
+/// @param num_cols Number of columns.
+/// @param seats Seat memory laid out as event_seats_size describes, that outlives the event. NULL to allocate it.
+/// @return Newly created event, NULL on failure.
+struct Event* create_event_at(struct EventList* list, unsigned int event_id, size_t num_rows, size_t num_cols,
+                              void* seats);
+
+/// Gets the size of the seat memory of an event: the reservation of every seat, padded to 8 bytes, then the
+/// occupancy bitmap.
+/// @param num_rows Number of rows.
+/// @param num_cols Number of columns.
+/// @return Size in bytes, data and occupied of the event are in a single block of this size.
+size_t event_seats_size(size_t num_rows, size_t num_cols);
+
+/// Frees an event that could not be added to its list.
+/// @note Only its seat mapping is released, the rest of its memory goes with the list.
+/// @param event Event to be freed.
+void free_event(struct Event* event);
+
+/// Starts using the seats of an event, a sparse event keeps its layout until event_seats_end.
+/// @note Seat locks are always taken before this, never while the seats are in use. Calls never nest: a
+/// thread using the seats must not start again, as a waiting event_densify would block the second call.
+/// @param event Event whose seats are used.
+/// @return The seat array of a dense event, NULL if the event is sparse.
+_Atomic unsigned int* event_seats_begin(struct Event* event);
+
+/// Stops using the seats of an event.
+/// @param event Event whose seats were used.
+void event_seats_end(struct Event* event);
+
+/// Gets a seat of a sparse event, while its seats are in use.
+/// @param event Sparse event.
+/// @param index Index of the seat.
+/// @param create 1 to allocate the chunk of the seat if it does not exist, 0 not to.
+/// @return Pointer to the seat, NULL if its chunk does not exist and was not allocated.
+_Atomic unsigned int* event_sparse_seat(struct Event* event, size_t index, int create);
+
+/// Turns a sparse event dense once enough of its chunks exist, otherwise does nothing.
+/// @note Must not be called while the seats of the event are in use by the calling thread.
+/// @param event Event to check.
+void event_densify(struct Event* event);
+
+/// Gets a seat lock of an event, initializing it on first use.
+/// @param event Event the lock belongs to.
+/// @param lock Index of the lock, less than num_locks.
+/// @return The lock, NULL if it could not be initialized.
+pthread_rwlock_t* event_seat_lock(struct Event* event, size_t lock);
+
 /// Removes a node from the list.
 /// @param list Event list to be modified.
 /// @return 0 if the node was removed successfully, 1 otherwise.
 void free_list(struct EventList* list);
 
 /// Retrieves an event in the list.
+/// @note Safe to call concurrently with appends.
 /// @param list Event list to be searched
 /// @param event_id Event id.
 /// @return Pointer to the event if found, NULL otherwise.
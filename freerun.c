@@ -0,0 +1,161 @@
+#include "freerun.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/// Combines the nodes of two adjacent ranges of the same length.
+/// @param left Node of the left range.
+/// @param right Node of the right range.
+/// @param length Number of seats in each range.
+/// @return Node of both ranges together.
+static struct RunNode combine(struct RunNode left, struct RunNode right, uint32_t length) {
+  struct RunNode node;
+  node.prefix = left.prefix == length ? length + right.prefix : left.prefix;
+  node.suffix = right.suffix == length ? length + left.suffix : right.suffix;
+  node.best = left.best > right.best ? left.best : right.best;
+  if (left.suffix + right.prefix > node.best) node.best = left.suffix + right.prefix;
+  return node;
+}
+
+/// Recomputes the longest run of a row in the row tree.
+static void update_row_best(struct FreeRunIndex *index, size_t row) {
+  size_t node = index->rowLeaves + row;
+  index->rowBest[node] = index->rowTrees[row][1].best;
+  for (node /= 2; node > 0; node /= 2) {
+    uint32_t left = index->rowBest[2 * node], right = index->rowBest[2 * node + 1];
+    index->rowBest[node] = left > right ? left : right;
+  }
+}
+
+/// Allocates and fills the tree of a row.
+/// @param index Index the row belongs to.
+/// @param words Occupancy bitmap of the row, NULL if it is all free.
+/// @return The tree, NULL if it could not be allocated.
+static struct RunNode *build_row(const struct FreeRunIndex *index, const _Atomic uint64_t *words) {
+  struct RunNode *tree = malloc(2 * index->leaves * sizeof(struct RunNode));
+  if (tree == NULL) return NULL;
+
+  for (size_t col = 0; col < index->leaves; col++) {
+    int free_seat = col < index->cols;
+    if (free_seat && words != NULL)
+      free_seat = !(atomic_load_explicit(&words[col / 64], memory_order_relaxed) & ((uint64_t)1 << (col % 64)));
+    uint32_t run = free_seat ? 1 : 0;
+    tree[index->leaves + col] = (struct RunNode){run, run, run};
+  }
+
+  uint32_t length = 1;
+  for (size_t level = index->leaves / 2; level > 0; level /= 2, length *= 2) {
+    for (size_t node = level; node < 2 * level; node++) tree[node] = combine(tree[2 * node], tree[2 * node + 1], length);
+  }
+  return tree;
+}
+
+struct FreeRunIndex *freerun_build(size_t rows, size_t cols, const _Atomic uint64_t *occupied, size_t row_words) {
+  struct FreeRunIndex *index = malloc(sizeof(struct FreeRunIndex));
+  if (index == NULL) return NULL;
+
+  index->rows = rows;
+  index->cols = cols;
+  index->leaves = 1;
+  while (index->leaves < cols) index->leaves *= 2;
+  index->rowLeaves = 1;
+  while (index->rowLeaves < rows) index->rowLeaves *= 2;
+
+  index->rowTrees = calloc(rows > 0 ? rows : 1, sizeof(struct RunNode *));
+  index->rowBest = calloc(2 * index->rowLeaves, sizeof(uint32_t));
+  if (index->rowTrees == NULL || index->rowBest == NULL) {
+    freerun_free(index);
+    return NULL;
+  }
+
+  for (size_t row = 0; row < rows; row++) {
+    const _Atomic uint64_t *words = &occupied[row * row_words];
+    int empty = 1;
+    for (size_t word = 0; word < row_words && empty; word++)
+      empty = atomic_load_explicit(&words[word], memory_order_relaxed) == 0;
+
+    if (empty) {
+      index->rowBest[index->rowLeaves + row] = (uint32_t)cols;
+      continue;
+    }
+    index->rowTrees[row] = build_row(index, words);
+    if (index->rowTrees[row] == NULL) {
+      freerun_free(index);
+      return NULL;
+    }
+    index->rowBest[index->rowLeaves + row] = index->rowTrees[row][1].best;
+  }
+
+  for (size_t node = index->rowLeaves - 1; node > 0; node--) {
+    uint32_t left = index->rowBest[2 * node], right = index->rowBest[2 * node + 1];
+    index->rowBest[node] = left > right ? left : right;
+  }
+
+  return index;
+}
+
+void freerun_free(struct FreeRunIndex *index) {
+  if (index == NULL) return;
+  if (index->rowTrees != NULL) {
+    for (size_t row = 0; row < index->rows; row++) free(index->rowTrees[row]);
+  }
+  free(index->rowTrees);
+  free(index->rowBest);
+  free(index);
+}
+
+int freerun_set(struct FreeRunIndex *index, size_t seat, int taken) {
+  size_t row = seat / index->cols;
+  struct RunNode *tree = index->rowTrees[row];
+  if (tree == NULL) {
+    if (!taken) return 0;
+    tree = build_row(index, NULL);
+    if (tree == NULL) return 1;
+    index->rowTrees[row] = tree;
+  }
+  size_t node = index->leaves + seat % index->cols;
+
+  uint32_t run = taken ? 0 : 1;
+  if (tree[node].best == run) return 0;
+  tree[node] = (struct RunNode){run, run, run};
+
+  uint32_t length = 1;
+  for (node /= 2; node > 0; node /= 2, length *= 2) tree[node] = combine(tree[2 * node], tree[2 * node + 1], length);
+
+  update_row_best(index, row);
+  return 0;
+}
+
+int freerun_find(const struct FreeRunIndex *index, size_t count, size_t *seat) {
+  if (index->rows == 0 || index->rowBest[1] < count) return 1;
+
+  // Frontmost row with a long enough run
+  size_t node = 1;
+  while (node < index->rowLeaves) node = index->rowBest[2 * node] >= count ? 2 * node : 2 * node + 1;
+  size_t row = node - index->rowLeaves;
+
+  // Leftmost run in it: in the left half, across the middle, or in the right half
+  const struct RunNode *tree = index->rowTrees[row];
+  if (tree == NULL) {
+    *seat = row * index->cols;
+    return 0;
+  }
+  size_t start = 0, length = index->leaves;
+  node = 1;
+  while (node < index->leaves) {
+    length /= 2;
+    const struct RunNode *left = &tree[2 * node], *right = &tree[2 * node + 1];
+    if (left->best >= count) {
+      node = 2 * node;
+    } else if (left->suffix + right->prefix >= count) {
+      *seat = row * index->cols + start + length - left->suffix;
+      return 0;
+    } else {
+      node = 2 * node + 1;
+      start += length;
+    }
+  }
+
+  *seat = row * index->cols + start;
+  return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef FREE_RUN_H
+#define FREE_RUN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Free seats at both ends of a range of a row, and the longest run of free seats in it
+struct RunNode {
+  uint32_t prefix;
+  uint32_t suffix;
+  uint32_t best;
+};
+
+// Index of the runs of free seats of an event.
+// Each row has a segment tree over its seats, and a max tree over the rows finds the first row with a long
+// enough run, so a search takes O(log rows + log cols). A row only gets its tree once one of its seats is
+// taken, so the index of a mostly empty venue stays small.
+struct FreeRunIndex {
+  size_t rows, cols;
+  size_t leaves;              // Leaves of each row tree, cols rounded up to a power of two
+  struct RunNode **rowTrees;  // Tree of each row, NULL while the row is all free. 2 * leaves nodes, node 1 is the
+                              // root, padding leaves count as taken
+  size_t rowLeaves;         // Leaves of the row tree, rows rounded up to a power of two
+  uint32_t *rowBest;        // Longest run of each subtree of rows, node 1 is the root
+};
+
+/// Builds the index of an event from its occupancy bitmap.
+/// @param rows Number of rows.
+/// @param cols Number of columns.
+/// @param occupied Occupancy bitmap, each row padded to row_words words.
+/// @param row_words Number of bitmap words per row.
+/// @return The index, NULL if it could not be allocated.
+struct FreeRunIndex *freerun_build(size_t rows, size_t cols, const _Atomic uint64_t *occupied, size_t row_words);
+
+/// Frees an index.
+/// @param index Index to free, may be NULL.
+void freerun_free(struct FreeRunIndex *index);
+
+/// Marks a seat as taken or free.
+/// @note Idempotent, marking a seat twice changes nothing.
+/// @param index Index to update.
+/// @param seat Index of the seat, row major and from 0.
+/// @param taken 1 if the seat is taken, 0 if it is free.
+/// @return 0 if the seat was marked, 1 if the tree of its row could not be allocated and the index is stale.
+int freerun_set(struct FreeRunIndex *index, size_t seat, int taken);
+
+/// Finds the first run of free seats long enough, in the frontmost row that has one and as far left as possible.
+/// @param index Index to search.
+/// @param count Number of seats needed, at least 1.
+/// @param seat Where to store the index of the first seat of the run.
+/// @return 0 if a run was found, 1 otherwise.
+int freerun_find(const struct FreeRunIndex *index, size_t count, size_t *seat);
+
+#endif  // FREE_RUN_H
@@ -0,0 +1,79 @@
+#include "latency.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "outbuffer.h"
+
+/// Finds the bucket of a value, exact below LATENCY_SUB_BUCKETS and log-linear above.
+/// @param value Value to place.
+/// @return Index of its bucket.
+static unsigned int bucket_of(unsigned long value) {
+  if (value < LATENCY_SUB_BUCKETS) return (unsigned int)value;
+
+  unsigned int exponent = 0;
+  while ((value >> exponent) >= 2 * LATENCY_SUB_BUCKETS) exponent++;
+  // value >> exponent is in [LATENCY_SUB_BUCKETS, 2 * LATENCY_SUB_BUCKETS)
+  return (exponent + 1) * LATENCY_SUB_BUCKETS + (unsigned int)(value >> exponent) - LATENCY_SUB_BUCKETS;
+}
+
+/// Gets the largest value that falls in a bucket.
+/// @param bucket Index of the bucket.
+/// @return Upper bound of the bucket.
+static unsigned long bucket_limit(unsigned int bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS) return bucket;
+
+  unsigned int exponent = bucket / LATENCY_SUB_BUCKETS - 1;
+  unsigned long mantissa = bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+  return ((mantissa + 1) << exponent) - 1;
+}
+
+void latency_init(struct LatencyHistogram *histogram) { memset(histogram, 0, sizeof(*histogram)); }
+
+void latency_record(struct LatencyHistogram *histogram, unsigned long ns) {
+  histogram->counts[bucket_of(ns)]++;
+  histogram->total++;
+  histogram->sum += ns;
+  if (ns > histogram->max) histogram->max = ns;
+}
+
+void latency_merge(struct LatencyHistogram *histogram, const struct LatencyHistogram *other) {
+  for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) histogram->counts[i] += other->counts[i];
+  histogram->total += other->total;
+  histogram->sum += other->sum;
+  if (other->max > histogram->max) histogram->max = other->max;
+}
+
+unsigned long latency_percentile(const struct LatencyHistogram *histogram, double fraction) {
+  if (histogram->total == 0) return 0;
+
+  unsigned long rank = (unsigned long)(fraction * (double)histogram->total);
+  if (rank >= histogram->total) rank = histogram->total - 1;
+
+  unsigned long seen = 0;
+  for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen > rank) {
+      unsigned long limit = bucket_limit(i);
+      return limit < histogram->max ? limit : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+int latency_write(const struct LatencyHistogram *histogram, int fd, const char *prefix) {
+  double mean = histogram->total ? (double)histogram->sum / (double)histogram->total : 0.0;
+
+  char text[512];
+  int len = snprintf(text, sizeof(text),
+                     "%scount %lu\n%smean_us %.3f\n%sp50_us %.3f\n%sp90_us %.3f\n%sp99_us %.3f\n%sp999_us %.3f\n"
+                     "%smax_us %.3f\n",
+                     prefix, histogram->total, prefix, mean / 1e3, prefix,
+                     (double)latency_percentile(histogram, 0.5) / 1e3, prefix,
+                     (double)latency_percentile(histogram, 0.9) / 1e3, prefix,
+                     (double)latency_percentile(histogram, 0.99) / 1e3, prefix,
+                     (double)latency_percentile(histogram, 0.999) / 1e3, prefix, (double)histogram->max / 1e3);
+  if (len < 0 || (size_t)len >= sizeof(text)) return 1;
+
+  return write_all(fd, text, (size_t)len);
+}
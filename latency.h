@@ -0,0 +1,42 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#define LATENCY_SUB_BUCKETS 16  // Buckets per power of two, so values are kept within 1/16 of their size
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+
+// Log-linear histogram of latencies in nanoseconds, owned by one thread while recording
+struct LatencyHistogram {
+  unsigned long counts[LATENCY_BUCKETS];
+  unsigned long total;  // Number of values recorded
+  unsigned long sum;    // Sum of the values recorded
+  unsigned long max;    // Largest value recorded
+};
+
+/// Initializes an empty histogram.
+/// @param histogram Histogram to initialize.
+void latency_init(struct LatencyHistogram *histogram);
+
+/// Records a latency.
+/// @param histogram Histogram to record into.
+/// @param ns Latency in nanoseconds.
+void latency_record(struct LatencyHistogram *histogram, unsigned long ns);
+
+/// Adds the values of a histogram to another.
+/// @param histogram Histogram to add to.
+/// @param other Histogram to add.
+void latency_merge(struct LatencyHistogram *histogram, const struct LatencyHistogram *other);
+
+/// Gets the latency below which a fraction of the values fall.
+/// @param histogram Histogram to read.
+/// @param fraction Fraction of the values, between 0 and 1.
+/// @return Upper bound of the bucket holding the percentile, in nanoseconds, 0 if nothing was recorded.
+unsigned long latency_percentile(const struct LatencyHistogram *histogram, double fraction);
+
+/// Writes a summary of the histogram, one "name value" pair per line.
+/// @param histogram Histogram to write.
+/// @param fd File descriptor of the file to write to.
+/// @param prefix Prefix of every name.
+/// @return 0 if everything was written, 1 otherwise.
+int latency_write(const struct LatencyHistogram *histogram, int fd, const char *prefix);
+
+#endif  // LATENCY_H
@@ -11,13 +11,96 @@
 #include <string.h>
 #include <wait.h>
 #include <pthread.h>
+#include <time.h>
 
+#include "compiled.h"
 #include "constants.h"
 #include "operations.h"
 #include "parser.h"
+#include "scheduler.h"
+
+/// Compiles a text job file to the binary format.
+/// @param input Path of the text job file.
+/// @param output Path of the compiled file.
+/// @return 0 if the file was compiled, 1 otherwise.
+static int compile_file(const char *input, const char *output) {
+  int fdin = open(input, O_RDONLY);
+  if (fdin < 0) {
+    fprintf(stderr, "open error: %s\n", strerror(errno));
+    return 1;
+  }
+
+  int fdout = open(output, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (fdout < 0) {
+    fprintf(stderr, "open error: %s\n", strerror(errno));
+    close(fdin);
+    return 1;
+  }
+
+  int result = compile_jobs(fdin, fdout);
+  parser_release(fdin);
+  close(fdin);
+  if (close(fdout) != 0) result = 1;
+  return result;
+}
 
 int main(int argc, char *argv[]) {
   unsigned int state_access_delay_ms = STATE_ACCESS_DELAY_MS;
+  int workers = 0;  // Run every file in this process on a shared pool of that many threads, if set
+  int schedule = 0;  // Order the files by size before running them, if set
+  enum ScheduleWeight weight = SCHEDULE_BYTES;
+
+  // Options come before the positional arguments
+  int option = 1;
+  while (option < argc && strncmp(argv[option], "--", 2) == 0) {
+    if (strcmp(argv[option], "--reserve=locks") == 0) {
+      ems_set_reserve_mode(RESERVE_LOCKS);
+    } else if (strcmp(argv[option], "--reserve=cas") == 0) {
+      ems_set_reserve_mode(RESERVE_CAS);
+    } else if (strncmp(argv[option], "--workers=", 10) == 0) {
+      workers = atoi(argv[option] + 10);
+      if (workers <= 0) {
+        fprintf(stderr, "Invalid number of workers\n");
+        return 1;
+      }
+    } else if (strcmp(argv[option], "--compile") == 0) {
+      // Offline step: compile one job file to the binary format and exit
+      if (option + 2 >= argc) {
+        fprintf(stderr, "Usage: %s --compile <input.jobs> <output.jobs>\n", argv[0]);
+        return 1;
+      }
+      return compile_file(argv[option + 1], argv[option + 2]);
+    } else if (strncmp(argv[option], "--snapshot=", 11) == 0) {
+      ems_set_snapshot(argv[option] + 11);
+    } else if (strcmp(argv[option], "--wal") == 0) {
+      ems_set_wal(1, WAL_FLUSH_INTERVAL_US);
+    } else if (strncmp(argv[option], "--wal=", 6) == 0) {
+      // Flush interval of the batches, in microseconds
+      char *endptr;
+      unsigned long interval = strtoul(argv[option] + 6, &endptr, 10);
+      if (*endptr != '\0' || endptr == argv[option] + 6 || interval > UINT_MAX) {
+        fprintf(stderr, "Invalid flush interval\n");
+        return 1;
+      }
+      ems_set_wal(1, (unsigned int)interval);
+    } else if (strncmp(argv[option], "--recover=", 10) == 0) {
+      ems_set_recover(argv[option] + 10);
+    } else if (strcmp(argv[option], "--stats") == 0) {
+      ems_set_stats(1);
+    } else if (strcmp(argv[option], "--schedule=size") == 0) {
+      schedule = 1;
+      weight = SCHEDULE_BYTES;
+    } else if (strcmp(argv[option], "--schedule=commands") == 0) {
+      schedule = 1;
+      weight = SCHEDULE_COMMANDS;
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[option]);
+      return 1;
+    }
+    option++;
+  }
+  argc -= option - 1;
+  argv += option - 1;
 
   if (argc > 5){
     return 1;
@@ -57,59 +140,115 @@ int main(int argc, char *argv[]) {
   }
 
   struct dirent *file;
+  char **filenames = NULL;
+  size_t count = 0;
 
-  int process_counter = 0;
-  while (1) {
-    if (process_counter >= maxProcesses){
-      // Wait for any process to end
-      int state;
-      if(wait(&state)==-1){return -1;}
-      printf("Process ended with state: %d\n", state);
-      process_counter--;
-    }
-      
-    file = readdir(dir);
-    if (file == NULL)
-      break;
-
-    // If the file is not the right type, dont create the process
+  while ((file = readdir(dir)) != NULL) {
+    // If the file is not the right type, dont run it
     size_t size = strlen(file->d_name);
-    if (!(strcmp(file->d_name, ".") != 0 && strcmp(file->d_name, "..") != 0 &&
-        !strcmp(file->d_name + (size > 5 ?  size - 5 : 0), ".jobs"))) {
-          continue;
-    }
-
-    pid_t pid = fork();
+    if (size <= 5 || strcmp(file->d_name + size - 5, ".jobs") != 0)
+      continue;
 
-    if (pid < 0){
-      fprintf(stderr, "Fork error\n");
+    char **grown = realloc(filenames, (count + 1) * sizeof(char *));
+    if (grown == NULL || (grown[count] = strdup(file->d_name)) == NULL) {
+      fprintf(stderr, "Failed to list the job files\n");
       return 1;
     }
+    filenames = grown;
+    count++;
+  }
+  closedir(dir);
 
-    if (pid == 0){
-      // Child  
-      if(ems_file(argv[1], file->d_name, maxThreads) == -1){
-        fprintf(stderr, "failed!\n");
-        exit(1);
+  int slots = workers > 0 ? workers : maxProcesses;
+  unsigned long predicted = 0, total = 0;
+  if (schedule && schedule_files(argv[1], filenames, count, slots, weight, &predicted, &total) != 0) {
+    fprintf(stderr, "Failed to schedule the job files\n");
+    for (size_t i = 0; i < count; i++)
+      free(filenames[i]);
+    free(filenames);
+    ems_terminate();
+    return 1;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int result = 0;
+  long fileNs = 0;  // Time each file took, added up, what running them one after the other would take
+
+  // When each child started, to time its file
+  pid_t *pids = calloc(count > 0 ? count : 1, sizeof(pid_t));
+  struct timespec *started = calloc(count > 0 ? count : 1, sizeof(struct timespec));
+  if (pids == NULL || started == NULL) {
+    fprintf(stderr, "Failed to list the job files\n");
+    return 1;
+  }
+
+  if (workers > 0) {
+    result = ems_run_files(argv[1], filenames, count, workers, maxThreads, &fileNs);
+    printf("Run ended with state: %d\n", result);
+  } else {
+    int process_counter = 0;
+    for (size_t i = 0; i <= count; i++) {
+      if (process_counter >= maxProcesses || i == count){
+        // Wait for any process to end, and for all of them after the last file
+        while (process_counter > 0) {
+          int state;
+          pid_t ended = wait(&state);
+          if(ended==-1){return -1;}
+          printf("Process ended with state: %d\n", state);
+          for (size_t j = 0; j < i; j++) {
+            if (pids[j] == ended) fileNs += elapsed_ns(&started[j]);
+          }
+          process_counter--;
+          if (i < count) break;
+        }
+      }
+      if (i == count)
+        break;
+
+      clock_gettime(CLOCK_MONOTONIC, &started[i]);
+      pid_t pid = fork();
+
+      if (pid < 0){
+        fprintf(stderr, "Fork error\n");
+        return 1;
+      }
+
+      if (pid == 0){
+        // Child
+        if(ems_file(argv[1], filenames[i], maxThreads) == -1){
+          fprintf(stderr, "failed!\n");
+          exit(1);
+        }
+        exit(0);
+      }
+      else{
+        // Parent
+        pids[i] = pid;
+        process_counter++;
       }
-      exit(0);
-    }
-    else{
-      // Parent
-      process_counter++;
     }
   }
 
-  while (process_counter > 0){
-    int state;
-    if(wait(&state)==-1){return -1;}
-    printf("Process ended with state: %d\n", state);
-    process_counter--;
+  if (schedule) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double actual = (double)(end.tv_sec - start.tv_sec) * 1e3 + (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+    double serial = (double)fileNs / 1e6;
+    // Both as a share of running every file in a row, 1 / slots at best
+    printf("Schedule: %zu files on %d slots, predicted makespan %.1f%% of %lu %s, actual makespan %.1f%% of "
+           "%.3f ms (%.3f ms)\n", count, slots, total > 0 ? 100.0 * (double)predicted / (double)total : 0.0, total,
+           weight == SCHEDULE_COMMANDS ? "commands" : "bytes", serial > 0 ? 100.0 * actual / serial : 0.0, serial,
+           actual);
   }
-  
-  closedir(dir);
+
+  free(pids);
+  free(started);
+
+  for (size_t i = 0; i < count; i++)
+    free(filenames[i]);
+  free(filenames);
 
   ems_terminate();
-  return 0;
-  
+  return result == 0 ? 0 : 1;
 }
@@ -11,20 +11,43 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stdint.h>
 
+#include "commandqueue.h"
+#include "compiled.h"
 #include "eventlist.h"
+#include "freerun.h"
 #include "constants.h"
 #include "operations.h"
+#include "outbuffer.h"
 #include "parser.h"
+#include "snapshot.h"
+#include "stats.h"
 
-pthread_mutex_t parseMutex;         // Lock for parsing command
-pthread_rwlock_t createEventLock;   // Lock for creating events
-pthread_rwlock_t waitCommandLock;   // Lock for the Wait command
-int barrierFound = 0;               // Flag for Barrier command
-unsigned int * threadWait;          // List of time for each thread to wait before executing
-
-static struct EventList* event_list = NULL;
+static struct EmsState default_state;                 // State of ems_init, used by threads with no state bound
+static _Thread_local struct EmsState* bound_state = NULL;  // State of the job file the thread is working on
+static _Atomic unsigned long last_generation = 0;    // Generation of the last state initialized
 static unsigned int state_access_delay_ms = 0;
+static enum ReserveMode reserve_mode = RESERVE_LOCKS;
+static int collect_stats = 0;
+static const char* snapshot_path = NULL;  // Snapshot every new state starts from, NULL to start empty
+static const char* recover_path = NULL;   // Reservation log every new state replays, NULL for none
+static int log_reservations = 0;
+static _Thread_local struct ThreadStats* thread_stats = NULL;  // Slot of the thread in the job file, NULL if not collecting
+static _Thread_local struct timespec seats_locked_at;         // When the thread last took a set of seat locks
+
+// Events are never freed before their state is destroyed, so a thread may keep pointers to the ones it used
+struct EventCacheEntry {
+  unsigned long generation;  // State the entry belongs to, 0 if empty
+  unsigned int id;
+  struct Event* event;
+};
+static _Thread_local struct EventCacheEntry event_cache[EVENT_CACHE_SIZE];
+static _Thread_local unsigned long cache_hits = 0;
+static _Thread_local unsigned long cache_misses = 0;
+
+/// Gets the state the calling thread works on.
+static struct EmsState* current_state() { return bound_state != NULL ? bound_state : &default_state; }
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
 /// @return Timespec with the given delay.
@@ -32,27 +55,97 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
   return (struct timespec){delay_ms / 1000, (delay_ms % 1000) * 1000000};
 }
 
+/// Sleeps for a simulated state access, counting it in the thread's stats.
+/// @param delay Time to sleep.
+static void state_access_sleep(struct timespec* delay) {
+  struct timespec start;
+  if (thread_stats != NULL) clock_gettime(CLOCK_MONOTONIC, &start);
+
+  nanosleep(delay, NULL);  // Should not be removed
+
+  if (thread_stats != NULL) {
+    thread_stats->sleeps++;
+    thread_stats->sleep_ns += (unsigned long)elapsed_ns(&start);
+  }
+}
+
 /// Gets the event with the given ID from the state.
 /// @note Will wait to simulate a real system accessing a costly memory resource.
 /// @param event_id The ID of the event to get.
 /// @return Pointer to the event if found, NULL otherwise.
 static struct Event* get_event_with_delay(unsigned int event_id) {
   struct timespec delay = delay_to_timespec(state_access_delay_ms);
-  nanosleep(&delay, NULL);  // Should not be removed
+  state_access_sleep(&delay);
 
-  return get_event(event_list, event_id);
+  return get_event(current_state()->event_list, event_id);
 }
 
-/// Gets the seat with the given index from the state.
-/// @note Will wait to simulate a real system accessing a costly memory resource.
-/// @param event Event to get the seat from.
-/// @param index Index of the seat to get.
-/// @return Pointer to the seat.
-static unsigned int* get_seat_with_delay(struct Event* event, size_t index) {
-  struct timespec delay = delay_to_timespec(state_access_delay_ms);
-  nanosleep(&delay, NULL);  // Should not be removed
+/// Gets the event with the given ID, from the thread's cache if it was used recently.
+/// @note Only pays the simulated delay on a cache miss.
+/// @param event_id The ID of the event to get.
+/// @return Pointer to the event if found, NULL otherwise.
+static struct Event* get_event_cached(unsigned int event_id) {
+  unsigned long generation = current_state()->generation;
+  struct EventCacheEntry* entry = &event_cache[event_id % EVENT_CACHE_SIZE];
+
+  if (entry->generation == generation && entry->id == event_id) {
+    cache_hits++;
+    return entry->event;
+  }
+
+  cache_misses++;
+  struct Event* event = get_event_with_delay(event_id);
+  if (event != NULL) {
+    // Missing events are not cached, they may be created later
+    entry->generation = generation;
+    entry->id = event_id;
+    entry->event = event;
+  }
+  return event;
+}
+
+/// Accesses a block of contiguous seats in the state.
+/// @note Will wait to simulate a real system accessing a costly memory resource, once per page of
+/// STATE_PAGE_SEATS seats that the block touches.
+/// @param first Index of the first seat of the block.
+/// @param count Number of seats in the block.
+static void access_seats_with_delay(size_t first, size_t count) {
+  size_t pages = count == 0 ? 0 : (first + count - 1) / STATE_PAGE_SEATS - first / STATE_PAGE_SEATS + 1;
+  unsigned long long delay_ns = (unsigned long long)state_access_delay_ms * 1000000ULL * pages;
+  struct timespec delay = {(time_t)(delay_ns / 1000000000ULL), (long)(delay_ns % 1000000000ULL)};
+  state_access_sleep(&delay);
+}
+
+/// Gets a seat of an event whose seats are in use, see event_seats_begin.
+/// @param event Event the seat belongs to.
+/// @param seats Seat array of the event, NULL if it is sparse.
+/// @param index Index of the seat.
+/// @param create 1 to allocate the chunk of the seat in a sparse event, for a seat about to be claimed.
+/// @return Pointer to the seat, NULL if it is in a chunk that does not exist or could not be allocated.
+static _Atomic unsigned int* seat_at(struct Event* event, _Atomic unsigned int* seats, size_t index, int create) {
+  return seats != NULL ? &seats[index] : event_sparse_seat(event, index, create);
+}
+
+/// Reads a seat of an event whose seats are in use, see event_seats_begin.
+/// @param event Event the seat belongs to.
+/// @param seats Seat array of the event, NULL if it is sparse.
+/// @param index Index of the seat.
+/// @return Reservation id of the seat, 0 if it is free.
+static unsigned int seat_value(struct Event* event, _Atomic unsigned int* seats, size_t index) {
+  _Atomic unsigned int* seat = seat_at(event, seats, index, 0);
+  return seat != NULL ? atomic_load_explicit(seat, memory_order_relaxed) : 0;
+}
 
-  return &event->data[index].value;
+/// Finds where a run of sorted seats that share a state page ends.
+/// @param seats Sorted seat indices.
+/// @param start Index in seats of the first seat of the run.
+/// @param n Number of seats.
+/// @return Index in seats one past the last seat of the run.
+static size_t page_run_end(const size_t* seats, size_t start, size_t n) {
+  size_t page = seats[start] / STATE_PAGE_SEATS;
+  size_t end = start + 1;
+  while (end < n && seats[end] / STATE_PAGE_SEATS == page) end++;
+  return end;
 }
 
 /// Gets the index of a seat.
@@ -63,179 +156,949 @@ static unsigned int* get_seat_with_delay(struct Event* event, size_t index) {
 /// @return Index of the seat.
 static size_t seat_index(struct Event* event, size_t row, size_t col) { return (row - 1) * event->cols + col - 1; }
 
-int writeToFile(int fd, char * buffer){
-  ssize_t bytes_written = write(fd, buffer, strlen(buffer));
-  if (bytes_written < 0){
-    fprintf(stderr, "write error: %s\n", strerror(errno));
+/// Initializes a barrier for a fixed number of threads.
+/// @param barrier Barrier to initialize.
+/// @param parties Number of threads that must arrive for the barrier to open.
+/// @return 0 if the barrier was initialized successfully, -1 otherwise.
+static int epoch_barrier_init(EpochBarrier *barrier, int parties) {
+  if (pthread_mutex_init(&barrier->mutex, NULL) != 0) return -1;
+  if (pthread_cond_init(&barrier->cond, NULL) != 0) {
+    pthread_mutex_destroy(&barrier->mutex);
     return -1;
   }
+  barrier->parties = parties;
+  barrier->arrived = 0;
+  barrier->epoch = 0;
+  return 0;
+}
+
+static void epoch_barrier_destroy(EpochBarrier *barrier) {
+  pthread_cond_destroy(&barrier->cond);
+  pthread_mutex_destroy(&barrier->mutex);
+}
+
+/// Waits until every party arrived at the barrier in the current epoch.
+/// @param barrier Barrier to wait on.
+/// @return 0 on success, -1 otherwise.
+static int epoch_barrier_wait(EpochBarrier *barrier) {
+  if (pthread_mutex_lock(&barrier->mutex) != 0) return -1;
+
+  unsigned long epoch = barrier->epoch;
+  if (++barrier->arrived == barrier->parties) {
+    barrier->arrived = 0;
+    barrier->epoch++;
+    pthread_cond_broadcast(&barrier->cond);
+  } else {
+    while (epoch == barrier->epoch) pthread_cond_wait(&barrier->cond, &barrier->mutex);
+  }
+
+  return pthread_mutex_unlock(&barrier->mutex) != 0 ? -1 : 0;
+}
+
+/// Removes a party from a barrier for good, opening the current epoch if every other party already arrived.
+/// @param barrier Barrier to leave.
+/// @param count Number of parties leaving.
+static void epoch_barrier_leave(EpochBarrier *barrier, int count) {
+  pthread_mutex_lock(&barrier->mutex);
+  barrier->parties -= count;
+  if (barrier->arrived > 0 && barrier->arrived >= barrier->parties) {
+    barrier->arrived = 0;
+    barrier->epoch++;
+    pthread_cond_broadcast(&barrier->cond);
+  }
+  pthread_mutex_unlock(&barrier->mutex);
+}
+
+/// Gets the occupancy bitmap word holding a seat.
+/// @param event Event the seat belongs to.
+/// @param index Index of the seat.
+/// @return Pointer to the word, the seat is its occupancy_bit.
+static _Atomic uint64_t* occupancy_word(struct Event* event, size_t index) {
+  return &event->occupied[(index / event->cols) * event->row_words + (index % event->cols) / 64];
+}
+
+static uint64_t occupancy_bit(struct Event* event, size_t index) { return (uint64_t)1 << (index % event->cols % 64); }
+
+/// Gets the index of the lock guarding a seat, every seat in a row shares it.
+/// @param event Event the seat belongs to.
+/// @param index Index of the seat.
+/// @return Index of the lock in event->seatLocks.
+static unsigned int seat_lock(struct Event* event, size_t index) {
+  return (unsigned int)((index / event->cols) % event->num_locks);
+}
+
+/// Gets the mask with every seat lock of an event.
+static uint64_t all_seat_locks(struct Event* event) {
+  return event->num_locks == 64 ? UINT64_MAX : ((uint64_t)1 << event->num_locks) - 1;
+}
+
+/// Locks a set of seat locks, always in increasing index order.
+/// @param event Event the locks belong to.
+/// @param locks Mask with bit i set if seatLocks[i] is to be locked.
+/// @param write 1 to lock for writing, 0 for reading.
+/// @return 0 if all the locks were taken, -1 otherwise.
+static int lock_seats(struct Event* event, uint64_t locks, int write) {
+  struct timespec start;
+  if (thread_stats != NULL) clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (size_t i = 0; i < event->num_locks; i++) {
+    if (!(locks & ((uint64_t)1 << i))) continue;
+
+    pthread_rwlock_t* lock = event_seat_lock(event, i);
+    if (lock == NULL) return -1;
+    int result = write ? pthread_rwlock_wrlock(lock) : pthread_rwlock_rdlock(lock);
+    if (result != 0) return -1;
+  }
+
+  if (thread_stats != NULL && locks != 0) {
+    clock_gettime(CLOCK_MONOTONIC, &seats_locked_at);
+    thread_stats->locks[STAT_LOCK_SEATS].acquisitions++;
+    thread_stats->locks[STAT_LOCK_SEATS].wait_ns += (unsigned long)elapsed_ns(&start);
+  }
+  return 0;
+}
+
+/// Unlocks a set of seat locks.
+/// @param event Event the locks belong to.
+/// @param locks Mask with bit i set if seatLocks[i] is to be unlocked.
+/// @return 0 if all the locks were released, -1 otherwise.
+static int unlock_seats(struct Event* event, uint64_t locks) {
+  for (size_t i = 0; i < event->num_locks; i++) {
+    if (!(locks & ((uint64_t)1 << i))) continue;
+
+    // Only locks taken by lock_seats are released, so they are already initialized
+    if (pthread_rwlock_unlock(&event->seatLocks[i]) != 0) return -1;
+  }
+
+  if (thread_stats != NULL && locks != 0) thread_stats->locks[STAT_LOCK_SEATS].hold_ns += (unsigned long)elapsed_ns(&seats_locked_at);
+  return 0;
+}
+
+/// Sorts seat indices with a least significant digit radix sort, one byte per pass.
+/// @param seats Seat indices to sort.
+/// @param scratch Array of the same size used between passes.
+/// @param n Number of seats.
+/// @return 1 if a seat appears more than once, 0 otherwise.
+static int sort_seats(size_t* seats, size_t* scratch, size_t n) {
+  size_t highBits = 0;
+  for (size_t i = 0; i < n; i++) highBits |= seats[i];
+
+  size_t* from = seats;
+  size_t* to = scratch;
+  for (unsigned int shift = 0; shift < sizeof(size_t) * 8 && (highBits >> shift) != 0; shift += 8) {
+    size_t count[257] = {0};
+    for (size_t i = 0; i < n; i++) count[((from[i] >> shift) & 0xff) + 1]++;
+    for (size_t b = 0; b < 256; b++) count[b + 1] += count[b];
+    for (size_t i = 0; i < n; i++) to[count[(from[i] >> shift) & 0xff]++] = from[i];
+
+    size_t* temp = from;
+    from = to;
+    to = temp;
+  }
+
+  if (from != seats) memcpy(seats, from, n * sizeof(size_t));
+
+  for (size_t i = 1; i < n; i++) {
+    if (seats[i] == seats[i - 1]) return 1;
+  }
+  return 0;
+}
+
+/// Claims the seats of a reservation without locks, one compare-and-swap per seat.
+/// @note The seats must be valid and sorted, if one of them is taken the ones already claimed are released.
+/// @param event Event to reserve the seats in.
+/// @param reservation_id Id written to the claimed seats.
+/// @param num_seats Number of seats to reserve.
+/// @param seats Indices of the seats to reserve.
+/// @return 0 if every seat was claimed, 1 if one of them is taken, -1 on error.
+static int reserve_with_cas(struct Event* event, unsigned int reservation_id, size_t num_seats, size_t* seats) {
+  _Atomic unsigned int* data = event_seats_begin(event);
+
+  size_t i = 0;
+  int conflict = 0;
+  while (i < num_seats && !conflict) {
+    size_t end = page_run_end(seats, i, num_seats);
+    access_seats_with_delay(seats[i], seats[end - 1] - seats[i] + 1);
+
+    for (; i < end; i++) {
+      _Atomic unsigned int* seat = seat_at(event, data, seats[i], 1);
+      unsigned int expected = 0;
+      if (seat == NULL) {
+        fprintf(stderr, "Error allocating memory for seats\n");
+        conflict = -1;
+        break;
+      }
+      if (!atomic_compare_exchange_strong_explicit(seat, &expected, reservation_id, memory_order_acq_rel,
+                                                   memory_order_relaxed)) {
+        conflict = 1;
+        break;
+      }
+      atomic_fetch_or_explicit(occupancy_word(event, seats[i]), occupancy_bit(event, seats[i]), memory_order_relaxed);
+    }
+  }
+
+  // Seats before i were claimed by this reservation, so their chunks exist
+  size_t claimed = conflict ? i : 0;
+  for (size_t j = 0; j < claimed;) {
+    size_t end = page_run_end(seats, j, claimed);
+    access_seats_with_delay(seats[j], seats[end - 1] - seats[j] + 1);
+
+    for (; j < end; j++) {
+      unsigned int expected = reservation_id;
+      atomic_fetch_and_explicit(occupancy_word(event, seats[j]), ~occupancy_bit(event, seats[j]), memory_order_relaxed);
+      atomic_compare_exchange_strong_explicit(seat_at(event, data, seats[j], 0), &expected, 0, memory_order_release,
+                                              memory_order_relaxed);
+    }
+  }
+
+  event_seats_end(event);
+  return conflict;
+}
+
+/// Claims a set of seats for a reservation, all of them or none.
+/// @note Uses the seats of the event itself, so the caller must not be using them. Once the claim is over
+/// the caller gives the event a chance to turn dense with event_densify.
+/// @param event Event the seats belong to.
+/// @param reservation_id Id of the reservation, unique in the event.
+/// @param num_seats Number of seats.
+/// @param seats Sorted and distinct seat indices.
+/// @return 0 if the seats were claimed, 1 if any of them is taken, -1 on error.
+static int claim_seats(struct Event* event, unsigned int reservation_id, size_t num_seats, size_t* seats) {
+  // Collect the locks of the seats before touching any of them.
+  // The bitmap check is only a hint, a seat taken after it is still caught below.
+  uint64_t locks = 0;
+  uint64_t taken = 0;
+  for (size_t i = 0; i < num_seats; i++) {
+    locks |= (uint64_t)1 << seat_lock(event, seats[i]);
+    taken |= atomic_load_explicit(occupancy_word(event, seats[i]), memory_order_relaxed) & occupancy_bit(event, seats[i]);
+  }
+
+  if (taken != 0) return 1;
+
+  if (reserve_mode == RESERVE_CAS) {
+    return reserve_with_cas(event, reservation_id, num_seats, seats);
+  }
+
+  if (lock_seats(event, locks, 1) != 0){return -1;}
+  _Atomic unsigned int* data = event_seats_begin(event);
+
+  // One state access per page of seats, both to check and to claim them
+  size_t i = 0;
+  int conflict = 0;
+  while (i < num_seats && !conflict) {
+    size_t end = page_run_end(seats, i, num_seats);
+    access_seats_with_delay(seats[i], seats[end - 1] - seats[i] + 1);
+
+    for (; i < end; i++) {
+      _Atomic unsigned int* seat = seat_at(event, data, seats[i], 1);
+
+      if (seat == NULL) {
+        fprintf(stderr, "Error allocating memory for seats\n");
+        conflict = -1;
+        break;
+      }
+      if (atomic_load_explicit(seat, memory_order_relaxed) != 0) {
+        conflict = 1;
+        break;
+      }
+
+      atomic_store_explicit(seat, reservation_id, memory_order_relaxed);
+      atomic_fetch_or_explicit(occupancy_word(event, seats[i]), occupancy_bit(event, seats[i]), memory_order_relaxed);
+    }
+  }
+  
+  // If the reservation was not successful, free the seats that were reserved.
+  if (conflict) {
+    size_t claimed = i;
+    for (size_t j = 0; j < claimed;) {
+      size_t end = page_run_end(seats, j, claimed);
+      access_seats_with_delay(seats[j], seats[end - 1] - seats[j] + 1);
+
+      for (; j < end; j++) {
+        atomic_store_explicit(seat_at(event, data, seats[j], 0), 0, memory_order_relaxed);
+        atomic_fetch_and_explicit(occupancy_word(event, seats[j]), ~occupancy_bit(event, seats[j]),
+                                  memory_order_relaxed);
+      }
+    }
+  }
+
+  event_seats_end(event);
+  if (unlock_seats(event, locks) != 0){return -1;}
+
+  return conflict;
+}
+
+/// Marks seats as taken in the free run index of an event, dropping the index if a row tree can not be allocated.
+/// @note The caller holds freeRunLock. A dropped index is built again by the next RESERVE_BEST.
+/// @param event Event the seats belong to.
+/// @param index Free run index of the event.
+/// @param num_seats Number of seats.
+/// @param seats Seat indices.
+/// @return 0 if the index was updated, 1 if it was dropped.
+static int mark_taken(struct Event* event, struct FreeRunIndex* index, size_t num_seats, const size_t* seats) {
+  for (size_t i = 0; i < num_seats; i++) {
+    if (freerun_set(index, seats[i], 1) != 0) {
+      atomic_store_explicit(&event->freeRuns, NULL, memory_order_release);
+      freerun_free(index);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/// Records claimed seats in the free run index of the event, if it has one.
+/// @param event Event the seats belong to.
+/// @param num_seats Number of seats.
+/// @param seats Seat indices.
+static void note_claimed(struct Event* event, size_t num_seats, size_t* seats) {
+  // Most events never get a RESERVE_BEST, so most reservations stop here
+  if (atomic_load_explicit(&event->freeRuns, memory_order_acquire) == NULL) return;
+
+  pthread_mutex_lock(&event->freeRunLock);
+  struct FreeRunIndex* index = atomic_load_explicit(&event->freeRuns, memory_order_relaxed);
+  if (index != NULL) mark_taken(event, index, num_seats, seats);
+  pthread_mutex_unlock(&event->freeRunLock);
+}
+
+void ems_set_reserve_mode(enum ReserveMode mode) { reserve_mode = mode; }
+
+void ems_set_stats(int enabled) { collect_stats = enabled; }
+
+void ems_bind_stats(struct ThreadStats* stats) { thread_stats = stats; }
+
+void ems_set_wal(int enabled, unsigned int interval_us) {
+  log_reservations = enabled;
+  wal_set_interval(interval_us);
+}
+
+void ems_set_recover(const char *path) { recover_path = path; }
+
+void ems_flush_cache_stats() {
+  struct EmsState* state = current_state();
+  atomic_fetch_add(&state->cache_hits, cache_hits);
+  atomic_fetch_add(&state->cache_misses, cache_misses);
+  cache_hits = 0;
+  cache_misses = 0;
+}
+
+void ems_cache_stats(struct EmsState *state, unsigned long *hits, unsigned long *misses) {
+  if (state == NULL) state = &default_state;
+  *hits = atomic_load(&state->cache_hits);
+  *misses = atomic_load(&state->cache_misses);
+}
+
+int writeToFile(int fd, char * buffer){
+  return write_all(fd, buffer, strlen(buffer)) != 0 ? -1 : 0;
+}
+
+void ems_set_snapshot(const char *path) { snapshot_path = path; }
+
+/// Applies a record of a reservation log to a list being recovered.
+/// @note Records already in the list, from the snapshot it was loaded from, are skipped. A reservation of an
+/// event with no CREATE is corruption, as an event is only found once its CREATE is durable.
+/// @param record Record to apply.
+/// @param seats Seat indices of a RESERVE record.
+/// @param context Event list to apply the record to.
+/// @return 0 if the record was applied, 1 otherwise.
+static int recover_record(const struct WalRecord* record, const uint64_t* seats, void* context) {
+  struct EventList* list = context;
+  struct Event* event = get_event(list, record->event_id);
+
+  if (record->type == WAL_CREATE) {
+    if (event != NULL && event->rows == record->a && event->cols == record->b) return 0;
+    if (event != NULL || record->a == 0 || record->b == 0) {
+      fprintf(stderr, "Conflicting creation of event %u in the reservation log\n", record->event_id);
+      return 1;
+    }
+
+    event = create_event(list, record->event_id, (size_t)record->a, (size_t)record->b);
+    if (event == NULL || append_to_list(list, event) != 0) {
+      fprintf(stderr, "Failed to recover event %u\n", record->event_id);
+      free_event(event);
+      return 1;
+    }
+    return 0;
+  }
+
+  if (event == NULL) {
+    fprintf(stderr, "Reservation of event %u without its creation in the reservation log\n", record->event_id);
+    return 1;
+  }
+
+  unsigned int reservation_id = (unsigned int)record->a;
+  if (reservation_id == 0 || reservation_id != record->a) {
+    fprintf(stderr, "Invalid reservation of event %u in the reservation log\n", record->event_id);
+    return 1;
+  }
+
+  // Nothing else runs on the list yet, seats are set directly
+  _Atomic unsigned int* data = event_seats_begin(event);
+  int result = 0;
+  for (size_t i = 0; i < (size_t)record->b && result == 0; i++) {
+    size_t seat = (size_t)seats[i];
+    _Atomic unsigned int* slot = seat < event->rows * event->cols ? seat_at(event, data, seat, 1) : NULL;
+    if (slot == NULL || (atomic_load(slot) != 0 && atomic_load(slot) != reservation_id)) {
+      fprintf(stderr, "Invalid reservation of event %u in the reservation log\n", record->event_id);
+      result = 1;
+      break;
+    }
+    atomic_store(slot, reservation_id);
+    atomic_fetch_or(occupancy_word(event, seat), occupancy_bit(event, seat));
+  }
+  event_seats_end(event);
+  if (result != 0) return 1;
+
+  if (atomic_load(&event->reservations) < reservation_id) atomic_store(&event->reservations, reservation_id);
+  event_densify(event);
+
   return 0;
 }
 
-void swap(size_t *x1, size_t *x2) {
-  size_t temp = *x1;
-  *x1 = *x2;
-  *x2 = temp;
+// A taken seat, as collected for a checkpoint of the reservation log
+struct TakenSeat {
+  unsigned int reservation_id;
+  uint64_t seat;
+};
+
+/// Orders taken seats by reservation, then by seat.
+static int compare_taken(const void* a, const void* b) {
+  const struct TakenSeat *ta = a, *tb = b;
+  if (ta->reservation_id != tb->reservation_id) return ta->reservation_id < tb->reservation_id ? -1 : 1;
+  return ta->seat < tb->seat ? -1 : ta->seat > tb->seat;
 }
 
-void sortReserves(size_t comparisonArr[], size_t otherArr[], size_t n) {
-  for (size_t i = 0; i < n-1; i++) {
-    for (size_t j = 0; j < n-i-1; j++) {
-      if (comparisonArr[j] > comparisonArr[j+1]) {
-        swap(&comparisonArr[j], &comparisonArr[j+1]);
-        swap(&otherArr[j], &otherArr[j+1]);
+/// Writes the events of a state to a log that was just opened, one CREATE per event and one RESERVE per
+/// reservation, so the log can be replayed on its own.
+/// @note Called before any command of the file runs. Without it the events of a snapshot or of a replayed
+/// log would be missing from the new log, and replaying it would fail on their reservations.
+/// @param list Events of the state.
+/// @param wal Log to write to.
+/// @return 0 if the events are durable, 1 otherwise.
+static int log_checkpoint(struct EventList* list, struct WriteAheadLog* wal) {
+  struct ListNode *current, *last;
+  list_snapshot(list, &current, &last);
+
+  int result = 0;
+  while (current != NULL && result == 0) {
+    struct Event* event = current->event;
+    size_t num_seats = event->rows * event->cols;
+
+    _Atomic unsigned int* data = event_seats_begin(event);
+    size_t count = 0;
+    for (size_t i = 0; i < num_seats; i++) count += seat_value(event, data, i) != 0;
+
+    struct TakenSeat* taken = malloc((count > 0 ? count : 1) * sizeof(struct TakenSeat));
+    struct WalRecord* records = malloc((count + 1) * sizeof(struct WalRecord));
+    uint64_t* seats = malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+    result = taken == NULL || records == NULL || seats == NULL;
+    for (size_t i = 0, n = 0; i < num_seats && !result; i++) {
+      unsigned int id = seat_value(event, data, i);
+      if (id != 0) taken[n++] = (struct TakenSeat){id, i};
+    }
+    event_seats_end(event);
+
+    if (!result) {
+      qsort(taken, count, sizeof(struct TakenSeat), compare_taken);
+
+      size_t num_records = 0;
+      records[num_records++] = (struct WalRecord){WAL_CREATE, event->id, event->rows, event->cols, 0};
+      for (size_t i = 0; i < count;) {
+        size_t end = i;
+        for (; end < count && taken[end].reservation_id == taken[i].reservation_id; end++) seats[end] = taken[end].seat;
+        records[num_records++] = (struct WalRecord){WAL_RESERVE, event->id, taken[i].reservation_id, end - i, 0};
+        i = end;
       }
+      result = wal_append(wal, records, seats, num_records) != 0;
     }
+
+    free(taken);
+    free(records);
+    free(seats);
+    current = current == last ? NULL : list_next(current);
+  }
+
+  if (result) fprintf(stderr, "Failed to write the events to the reservation log\n");
+  return result;
+}
+
+/// Makes a successful command durable, if the state of the calling thread keeps a log.
+/// @param type WAL_CREATE or WAL_RESERVE.
+/// @param event_id Id of the event.
+/// @param a Rows of a CREATE, reservation id of a RESERVE.
+/// @param b Columns of a CREATE, number of seats of a RESERVE.
+/// @param seats Seat indices of a RESERVE.
+/// @return 0 if the command is durable or there is no log, 1 otherwise.
+static int log_command(enum WalRecordType type, unsigned int event_id, size_t a, size_t b, const size_t* seats) {
+  struct WriteAheadLog* wal = current_state()->wal;
+  if (wal == NULL) return 0;
+
+  struct WalRecord record = {(uint32_t)type, event_id, a, b, 0};
+  size_t num_seats = type == WAL_RESERVE ? b : 0;
+  uint64_t indices[num_seats > 0 ? num_seats : 1];
+  for (size_t i = 0; i < num_seats; i++) indices[i] = seats[i];
+
+  if (wal_append(wal, &record, indices, 1) != 0) {
+    fprintf(stderr, "Failed to log the command\n");
+    return 1;
+  }
+  return 0;
+}
+
+int ems_state_init(struct EmsState *state) {
+  if (pthread_mutex_init(&state->createLock, NULL) != 0) {
+    state->event_list = NULL;
+    return 1;
   }
+  state->event_list = create_list();
+  if (state->event_list != NULL && snapshot_path != NULL && snapshot_load(state->event_list, snapshot_path) != 0) {
+    free_list(state->event_list);
+    state->event_list = NULL;
+  }
+  if (state->event_list != NULL && recover_path != NULL &&
+      wal_replay(recover_path, recover_record, state->event_list) != 0) {
+    free_list(state->event_list);
+    state->event_list = NULL;
+  }
+  state->wal = NULL;
+  // Never reused, so cached pointers of a destroyed state can not match a new one
+  state->generation = atomic_fetch_add(&last_generation, 1) + 1;
+  atomic_init(&state->cache_hits, 0);
+  atomic_init(&state->cache_misses, 0);
+
+  if (state->event_list == NULL) {
+    pthread_mutex_destroy(&state->createLock);
+    return 1;
+  }
+  return 0;
+}
+
+void ems_state_destroy(struct EmsState *state) {
+  free_list(state->event_list);
+  state->event_list = NULL;
+  pthread_mutex_destroy(&state->createLock);
 }
 
+void ems_bind_state(struct EmsState *state) { bound_state = state; }
+
 int ems_init(unsigned int delay_ms) {
-  if (event_list != NULL) {
+  if (default_state.event_list != NULL) {
     fprintf(stderr, "EMS state has already been initialized\n");
     return 1;
   }
 
-  event_list = create_list();
   state_access_delay_ms = delay_ms;
 
-  return event_list == NULL;
+  return ems_state_init(&default_state);
 }
 
 int ems_terminate() {
-  if (event_list == NULL) {
+  if (default_state.event_list == NULL) {
     fprintf(stderr, "EMS state must be initialized\n");
     return 1;
   }
 
-  free_list(event_list);
-  event_list = NULL;
+  ems_state_destroy(&default_state);
   return 0;
 }
 
 int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols) {
+  struct EmsState* state = current_state();
+  struct EventList* event_list = state->event_list;
   if (event_list == NULL) {
     fprintf(stderr, "EMS state must be initialized\n");
     return 1;
   }
 
-  if(pthread_rwlock_rdlock(&createEventLock)!=0){return -1;}
   if (get_event_with_delay(event_id) != NULL) {
     fprintf(stderr, "Event already exists\n");
-    if(pthread_rwlock_unlock(&createEventLock)!=0){return -1;}
     return 1;
   }
-  if(pthread_rwlock_unlock(&createEventLock)!=0){return -1;}
 
-  struct Event* event = malloc(sizeof(struct Event));
+  struct Event* event = create_event(event_list, event_id, num_rows, num_cols);
 
   if (event == NULL) {
     fprintf(stderr, "Error allocating memory for event\n");
     return 1;
   }
 
-  event->id = event_id;
-  event->rows = num_rows;
-  event->cols = num_cols;
-  atomic_store(&event->reservations, 0);
-  event->data = malloc(num_rows * num_cols * sizeof(struct data));
-
-  if (event->data == NULL) {
-    fprintf(stderr, "Error allocating memory for event data\n");
-    free(event);
-    return 1;
-  }
-
-  for (size_t i = 0; i < num_rows * num_cols; i++) {
-    event->data[i].value = 0;
-    if(pthread_rwlock_init(&event->data[i].seatLock, NULL)!=0){return -1;}
+  // A logged event is only added once its CREATE is durable, so every RESERVE of it is logged after the CREATE.
+  // Creations of the same event are serialized until then, or both could log a CREATE.
+  int logged = state->wal != NULL;
+  if (logged) {
+    pthread_mutex_lock(&state->createLock);
+    if (get_event(event_list, event_id) != NULL) {
+      pthread_mutex_unlock(&state->createLock);
+      fprintf(stderr, "Event already exists\n");
+      free_event(event);
+      return 1;
+    }
+    if (log_command(WAL_CREATE, event_id, num_rows, num_cols, NULL) != 0) {
+      pthread_mutex_unlock(&state->createLock);
+      free_event(event);
+      return 1;
+    }
   }
 
-  if (pthread_rwlock_wrlock(&createEventLock) != 0){return -1;}
-  if (append_to_list(event_list, event) != 0) {
-    fprintf(stderr, "Error appending event to list\n");
-    free(event->data);
-    free(event);
-    if(pthread_rwlock_unlock(&createEventLock)!= 0){return -1;}
+  int appended = append_to_list(event_list, event);
+  if (logged) pthread_mutex_unlock(&state->createLock);
+  if (appended != 0) {
+    if (appended == 2)
+      fprintf(stderr, "Event already exists\n");
+    else
+      fprintf(stderr, "Error appending event to list\n");
+    free_event(event);
     return 1;
   }
 
-  if(pthread_rwlock_unlock(&createEventLock)!= 0){return -1;}
   return 0;
 }
 
 int ems_reserve(unsigned int event_id, size_t num_seats, size_t* xs, size_t* ys) {
+  struct EventList* event_list = current_state()->event_list;
 
   if (event_list == NULL) {
     fprintf(stderr, "EMS state must be initialized\n");
     return 1;
   }
 
-  if(pthread_rwlock_rdlock(&createEventLock)!=0){return -1;}
-  struct Event* event = get_event_with_delay(event_id);
-  if(pthread_rwlock_unlock(&createEventLock)!=0){return -1;}
+  struct Event* event = get_event_cached(event_id);
 
   if (event == NULL) {
     fprintf(stderr, "Event not found\n");
     return 1;
   }
 
-  unsigned int lastReservation = atomic_load(&event->reservations);
-  unsigned int reservation_id = ++lastReservation;
-  atomic_store(&event->reservations, reservation_id);
+  // Ids must be unique, the CAS engine relies on them to roll back only its own seats
+  unsigned int reservation_id = atomic_fetch_add(&event->reservations, 1) + 1;
 
-  sortReserves(xs, ys, num_seats);
-  sortReserves(ys, xs, num_seats);
-
-  size_t i = 0;
-  for (; i < num_seats; i++) {
+  // Seats are handled by index from here on, sorted so that they are always claimed in the same order
+  size_t seats[num_seats > 0 ? num_seats : 1];
+  size_t scratch[num_seats > 0 ? num_seats : 1];
+  for (size_t i = 0; i < num_seats; i++) {
     size_t row = xs[i];
     size_t col = ys[i];
 
     if (row <= 0 || row > event->rows || col <= 0 || col > event->cols) {
       fprintf(stderr, "Invalid seat\n");
+      return 1;
+    }
+
+    seats[i] = seat_index(event, row, col);
+  }
+
+  if (sort_seats(seats, scratch, num_seats) != 0) {
+    fprintf(stderr, "Seat requested more than once\n");
+    return 1;
+  }
+
+  int claimed = claim_seats(event, reservation_id, num_seats, seats);
+  if (claimed == 1)
+    fprintf(stderr, "Seat already reserved\n");
+  else if (claimed == 0) {
+    event_densify(event);
+    note_claimed(event, num_seats, seats);
+    return log_command(WAL_RESERVE, event_id, reservation_id, num_seats, seats);
+  }
+
+  return claimed;
+}
+
+int ems_reserve_best(unsigned int event_id, size_t count) {
+  struct EventList* event_list = current_state()->event_list;
+
+  if (event_list == NULL) {
+    fprintf(stderr, "EMS state must be initialized\n");
+    return 1;
+  }
+
+  struct Event* event = get_event_cached(event_id);
+
+  if (event == NULL) {
+    fprintf(stderr, "Event not found\n");
+    return 1;
+  }
+
+  if (count == 0 || count > MAX_RESERVATION_SIZE || count > event->cols) {
+    fprintf(stderr, "Invalid seat count\n");
+    return 1;
+  }
+
+  unsigned int reservation_id = atomic_fetch_add(&event->reservations, 1) + 1;
+  size_t seats[count];
+
+  // Held for the whole search and claim, so two RESERVE_BEST never pick the same run
+  pthread_mutex_lock(&event->freeRunLock);
+  struct FreeRunIndex* index = atomic_load_explicit(&event->freeRuns, memory_order_relaxed);
+  int fresh = 0;
+  if (index == NULL) {
+    index = freerun_build(event->rows, event->cols, event->occupied, event->row_words);
+    if (index == NULL) {
+      pthread_mutex_unlock(&event->freeRunLock);
+      fprintf(stderr, "Error allocating memory for the seat index\n");
+      return 1;
+    }
+    atomic_store_explicit(&event->freeRuns, index, memory_order_release);
+    fresh = 1;
+  }
+
+  int result;
+  while (1) {
+    size_t first;
+    if (freerun_find(index, count, &first) != 0) {
+      // Seats of a reservation that was rolled back after the index read them are still marked, look once more
+      if (!fresh) {
+        struct FreeRunIndex* rebuilt = freerun_build(event->rows, event->cols, event->occupied, event->row_words);
+        if (rebuilt != NULL) {
+          atomic_store_explicit(&event->freeRuns, rebuilt, memory_order_release);
+          freerun_free(index);
+          index = rebuilt;
+          fresh = 1;
+          continue;
+        }
+      }
+      fprintf(stderr, "No contiguous seats available\n");
+      result = 1;
       break;
     }
 
-    size_t seatIndex = seat_index(event, row, col);
-    if(pthread_rwlock_wrlock(&event->data[seatIndex].seatLock)!=0){return -1;}
-    
-    if (*get_seat_with_delay(event, seatIndex) != 0) {
-      fprintf(stderr, "Seat already reserved\n");
-      if(pthread_rwlock_unlock(&event->data[seatIndex].seatLock)!=0){return -1;}
+    for (size_t i = 0; i < count; i++) seats[i] = first + i;
+
+    result = claim_seats(event, reservation_id, count, seats);
+    if (result != 1) break;
+
+    // A plain RESERVE got some of them first, catch up with the bitmap and search again
+    size_t taken[count];
+    size_t num_taken = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (atomic_load_explicit(occupancy_word(event, seats[i]), memory_order_relaxed) & occupancy_bit(event, seats[i]))
+        taken[num_taken++] = seats[i];
+    }
+    if (mark_taken(event, index, num_taken, taken) != 0) {
+      fprintf(stderr, "Error allocating memory for the seat index\n");
       break;
     }
+  }
+
+  if (result == 0) mark_taken(event, index, count, seats);
+  pthread_mutex_unlock(&event->freeRunLock);
 
-    *get_seat_with_delay(event, seatIndex) = reservation_id;
+  if (result == 0) {
+    event_densify(event);
+    result = log_command(WAL_RESERVE, event_id, reservation_id, count, seats);
   }
-  
-  // If the reservation was not successful, free the seats that were reserved.
-  if (i < num_seats) {
-    //atomic_store(&event->reservations, --reservation_id);
-    for (size_t j = 0; j < i; j++) {
-      size_t seatIndex = seat_index(event, xs[j], ys[j]);
-      *get_seat_with_delay(event, seatIndex) = 0;
-      if(pthread_rwlock_unlock(&event->data[seatIndex].seatLock)!=0){return -1;}
-    }
+  return result;
+}
+
+/// Makes the successful requests of a batch durable, if the state of the calling thread keeps a log.
+/// @param event_id Id of the event.
+/// @param ids Reservation id of each request.
+/// @param num_requests Number of requests.
+/// @param offsets Start of the seats of each request in seats, and the end of the last one.
+/// @param seats Sorted seat indices of every request.
+/// @param results Result of each request, only the ones that are 0 are logged.
+/// @return 0 if they are durable or there is no log, 1 otherwise.
+static int log_batch(unsigned int event_id, const unsigned int* ids, size_t num_requests, const size_t* offsets,
+                     const size_t* seats, const int* results) {
+  struct WriteAheadLog* wal = current_state()->wal;
+  if (wal == NULL) return 0;
+
+  struct WalRecord* records = malloc(num_requests * sizeof(struct WalRecord));
+  uint64_t* indices = malloc((offsets[num_requests] > 0 ? offsets[num_requests] : 1) * sizeof(uint64_t));
+  size_t count = 0, num_indices = 0;
+  int result = records == NULL || indices == NULL;
+
+  for (size_t r = 0; r < num_requests && !result; r++) {
+    if (results[r] != 0) continue;
+    struct WalRecord record = {WAL_RESERVE, event_id, ids[r], offsets[r + 1] - offsets[r], 0};
+    records[count++] = record;
+    for (size_t i = offsets[r]; i < offsets[r + 1]; i++) indices[num_indices++] = seats[i];
+  }
+
+  // A single append, so the whole batch waits for one write of the log
+  if (!result) result = wal_append(wal, records, indices, count) != 0;
+  if (result) fprintf(stderr, "Failed to log the command\n");
+
+  free(records);
+  free(indices);
+  return result;
+}
+
+int ems_reserve_batch(unsigned int event_id, size_t num_requests, const struct ReserveRequest* requests, int* results) {
+  struct EventList* event_list = current_state()->event_list;
+  for (size_t r = 0; r < num_requests; r++) results[r] = 1;
+
+  if (event_list == NULL) {
+    fprintf(stderr, "EMS state must be initialized\n");
+    return 1;
+  }
+
+  struct Event* event = get_event_cached(event_id);
+
+  if (event == NULL) {
+    fprintf(stderr, "Event not found\n");
     return 1;
-  }else{
-    for (size_t j = 0; j < i; j++) {
-      size_t seatIndex = seat_index(event, xs[j], ys[j]);
-      if(pthread_rwlock_unlock(&event->data[seatIndex].seatLock)!=0){return -1;}
+  }
+
+  if (num_requests == 0) return 0;
+
+  // Each seat is sorted once, keyed by its index and then its request, so the seats of the whole batch come
+  // out in page order and the ones of each request come out sorted
+  unsigned int shift = 0;
+  while ((num_requests - 1) >> shift != 0) shift++;
+  size_t mask = ((size_t)1 << shift) - 1;
+  if (event->rows * event->cols > (SIZE_MAX >> shift)) {
+    fprintf(stderr, "Too many requests for the event\n");
+    return 1;
+  }
+
+  size_t total = 0;
+  for (size_t r = 0; r < num_requests; r++) total += requests[r].num_seats;
+
+  size_t* keys = malloc((total > 0 ? total : 1) * sizeof(size_t));
+  size_t* seats = malloc((total > 0 ? total : 1) * sizeof(size_t));  // Also the scratch of the sort
+  size_t* offsets = calloc(2 * num_requests + 1, sizeof(size_t));    // Then the fill position of each request
+  int* invalid = calloc(num_requests, sizeof(int));  // 1 for an invalid seat, 2 for a repeated one, 3 if unparsed
+  unsigned int* ids = malloc(num_requests * sizeof(unsigned int));
+  if (keys == NULL || seats == NULL || offsets == NULL || invalid == NULL || ids == NULL) {
+    fprintf(stderr, "Error allocating memory for the batch\n");
+    free(keys);
+    free(seats);
+    free(offsets);
+    free(invalid);
+    free(ids);
+    return 1;
+  }
+
+  // Ids are taken up front, as if the requests that parsed were reserved one after the other
+  unsigned int parsed = 0;
+  for (size_t r = 0; r < num_requests; r++) parsed += requests[r].num_seats > 0;
+  unsigned int next_id = atomic_fetch_add(&event->reservations, parsed) + 1;
+
+  size_t n = 0;
+  for (size_t r = 0; r < num_requests; r++) {
+    const struct ReserveRequest* request = &requests[r];
+    if (request->num_seats == 0) invalid[r] = 3;
+    else ids[r] = next_id++;
+
+    for (size_t i = 0; i < request->num_seats && !invalid[r]; i++) {
+      size_t row = request->xs[i];
+      size_t col = request->ys[i];
+      if (row <= 0 || row > event->rows || col <= 0 || col > event->cols) invalid[r] = 1;
+    }
+    if (invalid[r]) continue;
+
+    for (size_t i = 0; i < request->num_seats; i++)
+      keys[n++] = (seat_index(event, request->xs[i], request->ys[i]) << shift) | r;
+  }
+
+  // Equal keys are a seat asked for twice by the same request
+  if (sort_seats(keys, seats, n) != 0) {
+    for (size_t i = 1; i < n; i++) {
+      if (keys[i] == keys[i - 1]) invalid[keys[i] & mask] = 2;
+    }
+  }
+
+  // Lay the seats out by request, each request keeps them sorted
+  size_t* fill = offsets + num_requests + 1;
+  for (size_t i = 0; i < n; i++) offsets[(keys[i] & mask) + 1]++;
+  for (size_t r = 0; r < num_requests; r++) offsets[r + 1] += offsets[r];
+  memcpy(fill, offsets, num_requests * sizeof(size_t));
+  for (size_t i = 0; i < n; i++) seats[fill[keys[i] & mask]++] = keys[i] >> shift;
+
+  int result = 0;
+  uint64_t locks = 0;
+  if (reserve_mode == RESERVE_LOCKS) {
+    for (size_t i = 0; i < n; i++) locks |= (uint64_t)1 << seat_lock(event, keys[i] >> shift);
+
+    if (lock_seats(event, locks, 1) != 0) {
+      fprintf(stderr, "Error locking the seats\n");
+      result = -1;
+    } else {
+      // One state access per page for the whole batch, not per request
+      for (size_t i = 0; i < n;) {
+        size_t first = keys[i] >> shift;
+        size_t last = first;
+        for (; i < n && (keys[i] >> shift) / STATE_PAGE_SEATS == first / STATE_PAGE_SEATS; i++) last = keys[i] >> shift;
+        access_seats_with_delay(first, last - first + 1);
+      }
+    }
+  }
+
+  // The CAS path claims each request through claim_seats, which starts using the seats itself
+  int in_use = reserve_mode == RESERVE_LOCKS && result != -1;
+  _Atomic unsigned int* data = in_use ? event_seats_begin(event) : NULL;
+
+  for (size_t r = 0; r < num_requests && result != -1; r++) {
+    size_t* request_seats = &seats[offsets[r]];
+    size_t count = offsets[r + 1] - offsets[r];
+    unsigned int reservation_id = ids[r];
+
+    if (invalid[r] == 1) {
+      fprintf(stderr, "Invalid seat\n");
+    } else if (invalid[r] == 2) {
+      fprintf(stderr, "Seat requested more than once\n");
+    } else if (invalid[r] == 0 && reserve_mode == RESERVE_CAS) {
+      results[r] = claim_seats(event, reservation_id, count, request_seats) != 0;
+      if (results[r]) fprintf(stderr, "Seat already reserved\n");
+    } else if (invalid[r] == 0) {
+      // Every lock of the batch is held, so the seats can not change between the check and the claim.
+      // The chunks of a sparse event are only allocated by the claim, so a request that fails allocates none.
+      int taken = 0;
+      for (size_t i = 0; i < count && !taken; i++) taken = seat_value(event, data, request_seats[i]) != 0;
+
+      size_t claimed = 0;
+      for (; !taken && claimed < count; claimed++) {
+        _Atomic unsigned int* seat = seat_at(event, data, request_seats[claimed], 1);
+        if (seat == NULL) break;
+        atomic_store_explicit(seat, reservation_id, memory_order_relaxed);
+        atomic_fetch_or_explicit(occupancy_word(event, request_seats[claimed]),
+                                 occupancy_bit(event, request_seats[claimed]), memory_order_relaxed);
+      }
+
+      if (taken) {
+        fprintf(stderr, "Seat already reserved\n");
+      } else if (claimed < count) {
+        for (size_t i = 0; i < claimed; i++) {
+          atomic_store_explicit(seat_at(event, data, request_seats[i], 0), 0, memory_order_relaxed);
+          atomic_fetch_and_explicit(occupancy_word(event, request_seats[i]), ~occupancy_bit(event, request_seats[i]),
+                                    memory_order_relaxed);
+        }
+        fprintf(stderr, "Error allocating memory for seats\n");
+      } else {
+        results[r] = 0;
+      }
     }
-    return 0;
   }
+
+  if (in_use) event_seats_end(event);
+  if (reserve_mode == RESERVE_LOCKS && result != -1 && unlock_seats(event, locks) != 0) result = -1;
+  event_densify(event);
+
+  for (size_t r = 0; r < num_requests; r++) {
+    if (results[r] == 0)
+      note_claimed(event, offsets[r + 1] - offsets[r], &seats[offsets[r]]);
+    else if (result == 0)
+      result = 1;
+  }
+  if (log_batch(event_id, ids, num_requests, offsets, seats, results) != 0) result = 1;
+
+  free(keys);
+  free(seats);
+  free(offsets);
+  free(invalid);
+  free(ids);
+  return result != 0;
 }
 
-int ems_show(unsigned int event_id, int fd) {
+int ems_show_to(unsigned int event_id, struct OutBuffer *buffer) {
+  struct EventList* event_list = current_state()->event_list;
 
   if (event_list == NULL) {
     fprintf(stderr, "EMS state must be initialized\n");
     return 1;
   }
 
-  if(pthread_rwlock_rdlock(&createEventLock)!=0){return -1;}
-  struct Event* event = get_event_with_delay(event_id);
-  if(pthread_rwlock_unlock(&createEventLock)!=0){return -1;}
+  struct Event* event = get_event_cached(event_id);
 
 
   if (event == NULL) {
@@ -243,74 +1106,214 @@ int ems_show(unsigned int event_id, int fd) {
     return 1;
   }
 
-  char buffer[10000];
-  char smallBuffer[10];
-  memset(buffer, 0, sizeof(buffer));
+  // Seat ids never exceed the reservation counter, so this is enough for the whole rendering
+  size_t seatWidth = uint_digits(atomic_load(&event->reservations)) + 1;
+  if (outbuf_reserve(buffer, event->rows * event->cols * seatWidth + event->rows) != 0) {
+    fprintf(stderr, "Error allocating memory for output\n");
+    return 1;
+  }
+
+  // Without seat locks there is nothing to wait for, the snapshot may include claims that are rolled back later
+  uint64_t locks = reserve_mode == RESERVE_LOCKS ? all_seat_locks(event) : 0;
+  if (lock_seats(event, locks, 0) != 0){return -1;}
 
-  for (size_t i = 1; i <= event->rows; i++) {
+  int result = 0;
+  access_seats_with_delay(0, event->rows * event->cols);
+  _Atomic unsigned int* seats = event_seats_begin(event);
+  for (size_t i = 1; i <= event->rows && result == 0; i++) {
     for (size_t j = 1; j <= event->cols; j++) {
 
       size_t seatIndex = seat_index(event, i, j);
-      if(pthread_rwlock_rdlock(&event->data[seatIndex].seatLock)!=0){return -1;}
-
-      unsigned int* seat = get_seat_with_delay(event, seatIndex);
-
-      snprintf(smallBuffer, sizeof(smallBuffer), "%u", *seat);
-      strcat(buffer, smallBuffer);
+      result |= outbuf_put_uint(buffer, seat_value(event, seats, seatIndex));
 
       if (j < event->cols) {
-        strcat(buffer, " ");
+        result |= outbuf_put_char(buffer, ' ');
       }
     }
 
-    strcat(buffer, "\n");
+    result |= outbuf_put_char(buffer, '\n');
   }
+  event_seats_end(event);
 
+  if (unlock_seats(event, locks) != 0){return -1;}
 
-  for (size_t i = 1; i <= event->rows; i++) {
-    for (size_t j = 1; j <= event->cols; j++) {
-      size_t seatIndex = seat_index(event, i, j);
-      if(pthread_rwlock_unlock(&event->data[seatIndex].seatLock)!= 0){return -1;}
+  if (result != 0)
+    fprintf(stderr, "Error allocating memory for output\n");
+
+  return result;
+}
+
+/// Copies row ranges of a SHOW split in parts until none is left, while the seats are held.
+/// @param show Parts of the SHOW.
+static void show_copy_ranges(struct ShowParts* show) {
+  size_t range;
+  while ((range = atomic_fetch_add(&show->nextRange, 1)) < show->num_parts) {
+    size_t first = range * show->rows / show->num_parts * show->cols;
+    size_t end = (range + 1) * show->rows / show->num_parts * show->cols;
+    access_seats_with_delay(first, end - first);
+    for (size_t i = first; i < end; i++) show->seats[i] = seat_value(show->event, show->data, i);
+  }
+}
+
+/// Copies the seats of an event for a SHOW split in parts, as of one point in time.
+/// @note The seats are held until every range is copied, by this part or by the others that start meanwhile.
+/// Only ranges already taken are waited for, never a part that has not started, which could be stuck behind
+/// a reservation waiting for these very seats.
+/// @param show Parts of the SHOW, its seats and dimensions are filled in.
+/// @return 0 if the seats were copied, 1 otherwise.
+static int show_copy(struct ShowParts* show) {
+  struct Event* event = get_event_cached(show->event_id);
+  if (event == NULL) {
+    fprintf(stderr, "Event not found\n");
+    return 1;
+  }
+
+  show->seats = malloc(event->rows * event->cols * sizeof(unsigned int));
+  if (show->seats == NULL) {
+    fprintf(stderr, "Error allocating memory for output\n");
+    return 1;
+  }
+
+  uint64_t locks = reserve_mode == RESERVE_LOCKS ? all_seat_locks(event) : 0;
+  if (lock_seats(event, locks, 0) != 0) return 1;
+
+  pthread_mutex_lock(&show->lock);
+  show->event = event;
+  show->data = event_seats_begin(event);
+  show->rows = event->rows;
+  show->cols = event->cols;
+  show->state = SHOW_COPY_RUNNING;
+  pthread_cond_broadcast(&show->changed);
+  pthread_mutex_unlock(&show->lock);
+
+  show_copy_ranges(show);
+
+  pthread_mutex_lock(&show->lock);
+  while (show->copiers > 0) pthread_cond_wait(&show->changed, &show->lock);
+  pthread_mutex_unlock(&show->lock);
+
+  event_seats_end(event);
+  // Read after the seats, so no reservation id in the copy is above it
+  show->seatWidth = uint_digits(atomic_load(&event->reservations)) + 1;
+
+  return unlock_seats(event, locks) != 0;
+}
+
+int ems_show_part(struct ShowParts* show, size_t part, struct OutBuffer* buffer) {
+  pthread_mutex_lock(&show->lock);
+  int copier = show->state == SHOW_COPY_PENDING;
+  if (copier) {
+    show->state = SHOW_COPY_LOCKING;
+    pthread_mutex_unlock(&show->lock);
+    int failed = show_copy(show);
+
+    pthread_mutex_lock(&show->lock);
+    show->state = failed ? SHOW_COPY_FAILED : SHOW_COPY_DONE;
+    pthread_cond_broadcast(&show->changed);
+  }
+
+  // Help with the copy while ranges are left, then wait for it to end
+  while (show->state == SHOW_COPY_LOCKING || show->state == SHOW_COPY_RUNNING) {
+    if (show->state == SHOW_COPY_RUNNING && atomic_load(&show->nextRange) < show->num_parts) {
+      show->copiers++;
+      pthread_mutex_unlock(&show->lock);
+      show_copy_ranges(show);
+      pthread_mutex_lock(&show->lock);
+      if (--show->copiers == 0) pthread_cond_broadcast(&show->changed);
+    } else {
+      pthread_cond_wait(&show->changed, &show->lock);
+    }
+  }
+  enum ShowCopyState state = show->state;
+  pthread_mutex_unlock(&show->lock);
+
+  // Only the part that made the copy reports its failure, the others leave their output empty
+  if (state == SHOW_COPY_FAILED) return copier;
+
+  size_t first = part * show->rows / show->num_parts;
+  size_t end = (part + 1) * show->rows / show->num_parts;
+  int result = outbuf_reserve(buffer, (end - first) * (show->cols * show->seatWidth + 1));
+  for (size_t i = first; i < end && result == 0; i++) {
+    const unsigned int* row = &show->seats[i * show->cols];
+    for (size_t j = 0; j < show->cols; j++) {
+      result |= outbuf_put_uint(buffer, row[j]);
+      if (j + 1 < show->cols) result |= outbuf_put_char(buffer, ' ');
     }
+    result |= outbuf_put_char(buffer, '\n');
   }
 
-  writeToFile(fd,buffer);
+  if (result != 0)
+    fprintf(stderr, "Error allocating memory for output\n");
 
-  return 0;
+  return result;
 }
 
-int ems_list_events(int fd) {
-  
-  if(pthread_rwlock_wrlock(&createEventLock)!=0){return -1;}
+int ems_list_events_to(struct OutBuffer *buffer, struct OutSequencer *output, unsigned long seq) {
+  struct EventList* event_list = current_state()->event_list;
   if (event_list == NULL) {
     fprintf(stderr, "EMS state must be initialized\n");
-    if(pthread_rwlock_unlock(&createEventLock)!=0){return -1;}
     return 1;
   }
 
-  if (event_list->head == NULL) {
-    writeToFile(fd, "No events\n");
-    if(pthread_rwlock_unlock(&createEventLock)!=0){return -1;}
-    return 0;
+  // Events created after this point are not listed, the rest can be walked without any lock
+  struct ListNode *current, *last;
+  list_snapshot(event_list, &current, &last);
+
+  if (current == NULL)
+    return outbuf_put(buffer, "No events\n", 10);
+
+  int result = 0;
+
+  while (current != NULL && result == 0) {
+    result |= outbuf_put(buffer, "Event: ", 7);
+    result |= outbuf_put_uint(buffer, (current->event)->id);
+    result |= outbuf_put_char(buffer, '\n');
+
+    if (output != NULL && buffer->len >= LIST_CHUNK_SIZE && result == 0)
+      result = outseq_stream(output, seq, buffer);
+
+    current = current == last ? NULL : list_next(current);
   }
-  struct ListNode* current = event_list->head;
 
-  char buffer[10000];
-  memset(buffer, 0, sizeof(buffer));
-  char smallBuffer[10];
+  if (result != 0)
+    fprintf(stderr, "Error listing events\n");
+
+  return result;
+}
 
-  while (current != NULL) {
-    strcat(buffer,"Event: ");
-    snprintf(smallBuffer, sizeof(smallBuffer), "%u", (current->event)->id);
-    strcat(buffer, smallBuffer);
-    strcat(buffer, "\n");
-    current = current->next;
+int ems_snapshot(const char *path) {
+  struct EventList* event_list = current_state()->event_list;
+  if (event_list == NULL) {
+    fprintf(stderr, "EMS state must be initialized\n");
+    return 1;
   }
 
-  writeToFile(fd, buffer);
-  if(pthread_rwlock_unlock(&createEventLock)!=0){return -1;}
-  
-  return 0;
+  // Events created after this point are left out, like in LIST
+  struct ListNode *current, *last;
+  list_snapshot(event_list, &current, &last);
+
+  struct SnapshotWriter writer;
+  if (snapshot_begin(&writer, path) != 0) return 1;
+
+  int ok = 1;
+  while (current != NULL && ok) {
+    struct Event* event = current->event;
+
+    // Each event is written as of one point in time, as SHOW would print it
+    uint64_t locks = reserve_mode == RESERVE_LOCKS ? all_seat_locks(event) : 0;
+    if (lock_seats(event, locks, 0) != 0) {
+      ok = 0;
+      break;
+    }
+    access_seats_with_delay(0, event->rows * event->cols);
+    // Read after the seats, so no reservation id in them is above it
+    ok = snapshot_add(&writer, event, atomic_load(&event->reservations)) == 0;
+    if (unlock_seats(event, locks) != 0) ok = 0;
+
+    current = current == last ? NULL : list_next(current);
+  }
+
+  return snapshot_end(&writer, ok);
 }
 
 void ems_wait(unsigned int delay_ms) {
@@ -318,199 +1321,566 @@ void ems_wait(unsigned int delay_ms) {
   nanosleep(&delay, NULL);
 }
 
-int ems_file(char * dirPath,char * filename, int maxThreads){
+int jobfile_open(JobFile *file, char *dirPath, char *filename, int maxThreads, struct EmsState *state){
   char filePathIn[strlen(dirPath)+strlen(filename)+2];
   snprintf(filePathIn, sizeof(filePathIn), "%s/%s", dirPath, filename);
 
   char filePathOut[strlen(dirPath)+strlen(filename)+2];
   char fileNameParsed[strlen(filename)];
   memset(fileNameParsed, 0, sizeof(fileNameParsed));
-  strncpy(fileNameParsed, filename, strlen(filename)-5);
+  memcpy(fileNameParsed, filename, strlen(filename)-5);
   snprintf(filePathOut, sizeof(filePathOut), "%s/%s.out", dirPath, fileNameParsed);
 
-  int fdout = open(filePathOut,O_CREAT | O_TRUNC | O_WRONLY , S_IRUSR | S_IWUSR);
-  if (fdout < 0){
+  file->fdout = open(filePathOut,O_CREAT | O_TRUNC | O_WRONLY , S_IRUSR | S_IWUSR);
+  if (file->fdout < 0){
+      fprintf(stderr, "open error: %s\n", strerror(errno));
+      return -1;
+  }
+
+  file->fdin = open(filePathIn,O_RDONLY);
+  if (file->fdin < 0){
       fprintf(stderr, "open error: %s\n", strerror(errno));
+      close(file->fdout);
+      return -1;
+  }
+
+  file->compiled.mapping = NULL;
+  if (compiled_open(file->fdin, &file->compiled) < 0){
+      close(file->fdin);
+      close(file->fdout);
       return -1;
   }
 
-  int fdin = open(filePathIn,O_RDONLY);
-  if (fdin < 0){
+  file->fdstats = -1;
+  file->stats = NULL;
+  if (collect_stats){
+    char filePathStats[strlen(dirPath)+strlen(filename)+4];
+    snprintf(filePathStats, sizeof(filePathStats), "%s/%s.stats", dirPath, fileNameParsed);
+
+    // One slot per thread, and the last one for the thread reading the file
+    file->stats = malloc((size_t)(maxThreads + 1) * sizeof(struct ThreadStats));
+    file->fdstats = open(filePathStats,O_CREAT | O_TRUNC | O_WRONLY , S_IRUSR | S_IWUSR);
+    if (file->stats == NULL || file->fdstats < 0){
       fprintf(stderr, "open error: %s\n", strerror(errno));
+      free(file->stats);
+      if (file->fdstats >= 0) close(file->fdstats);
+      compiled_close(&file->compiled);
+      close(file->fdin);
+      close(file->fdout);
       return -1;
+    }
+    for (int i = 0; i <= maxThreads; i++)
+      stats_init(&file->stats[i]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &file->opened);
+
+  file->name = filename;
+  file->max_threads = maxThreads;
+  file->state = state;
+  file->barriers = 0;
+  file->barrierNs = 0;
+
+  file->nextSeq = 0;
+  file->pendingShow = NULL;
+  file->nextPart = 0;
+
+  file->wal = NULL;
+  if (log_reservations){
+    char filePathWal[strlen(dirPath)+strlen(filename)+2];
+    snprintf(filePathWal, sizeof(filePathWal), "%s/%s.wal", dirPath, fileNameParsed);
+
+    // The log starts with the events the state was loaded with, if any
+    struct EmsState *owner = state != NULL ? state : &default_state;
+    file->wal = malloc(sizeof(struct WriteAheadLog));
+    if (file->wal == NULL || wal_open(file->wal, filePathWal) != 0){
+      free(file->wal);
+      file->wal = NULL;
+    } else if (log_checkpoint(owner->event_list, file->wal) != 0){
+      wal_close(file->wal);
+      free(file->wal);
+      file->wal = NULL;
+    }
+  }
+
+  file->threadWait = calloc((size_t)maxThreads, sizeof(unsigned int));
+  if ((log_reservations && file->wal == NULL) || !file->threadWait ||
+      pthread_mutex_init(&file->waitLock, NULL) != 0 || outseq_init(&file->output, file->fdout) != 0){
+    if (file->wal != NULL){
+      wal_close(file->wal);
+      free(file->wal);
+    }
+    free(file->threadWait);
+    free(file->stats);
+    if (file->fdstats >= 0) close(file->fdstats);
+    compiled_close(&file->compiled);
+    close(file->fdin);
+    close(file->fdout);
+    return -1;
+  }
+
+  (state != NULL ? state : &default_state)->wal = file->wal;
+  return 0;
+}
+
+/// Writes the barrier and event cache counters of a job file, one "name value" pair per line.
+/// @param file Job file whose threads have all finished.
+/// @param fd File descriptor of the file to write to.
+/// @return 0 if everything was written, 1 otherwise.
+static int write_file_stats(const JobFile *file, int fd){
+  unsigned long hits, misses;
+  ems_cache_stats(file->state, &hits, &misses);
+
+  char text[160];
+  int len = snprintf(text, sizeof(text),
+                     "barriers %lu\nbarrier_wait_ms %.3f\nevent_cache_hits %lu\nevent_cache_misses %lu\n",
+                     file->barriers, (double)file->barrierNs / 1e6, hits, misses);
+  return write_all(fd, text, (size_t)len);
+}
+
+void jobfile_close(JobFile *file){
+  if (outseq_destroy(&file->output) != 0)
+    fprintf(stderr, "Failed to write the output of %s\n", file->name);
+
+  if (file->wal != NULL){
+    (file->state != NULL ? file->state : &default_state)->wal = NULL;
+    if (wal_close(file->wal) != 0)
+      fprintf(stderr, "Failed to write the reservation log of %s\n", file->name);
+  }
+
+  if (file->stats != NULL){
+    if (stats_write(file->stats, (size_t)file->max_threads + 1, file->fdstats, elapsed_ns(&file->opened)) != 0 ||
+        write_file_stats(file, file->fdstats) != 0 || (file->wal != NULL && wal_write_stats(file->wal, file->fdstats) != 0))
+      fprintf(stderr, "Failed to write the stats of %s\n", file->name);
+    free(file->stats);
+    close(file->fdstats);
   }
 
-  if (pthread_mutex_init(&parseMutex, NULL)!= 0){return -1;}
-  if (pthread_rwlock_init(&createEventLock, NULL)!=0){return -1;}
-  if (pthread_rwlock_init(&waitCommandLock,NULL)!=0){return -1;}
+  free(file->wal);
+  pthread_mutex_destroy(&file->waitLock);
+  free(file->threadWait);
+  compiled_close(&file->compiled);
+  parser_release(file->fdin);
+  close(file->fdin);
+  close(file->fdout);
+}
+
+long elapsed_ns(struct timespec *start){
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1000000000L + (end.tv_nsec - start->tv_nsec);
+}
+
+int ems_file(char * dirPath,char * filename, int maxThreads){
+  JobFile file;
+  if (jobfile_open(&file, dirPath, filename, maxThreads, NULL) != 0){return -1;}
+
+  struct CommandQueue queue;
+  if (queue_init(&queue, COMMAND_QUEUE_SIZE) != 0){
+    jobfile_close(&file);
+    return -1;
+  }
 
-  long unsigned int max = (long unsigned int) maxThreads;
-  long unsigned int size = max * sizeof(int);
-  threadWait = malloc(size);
-  if(!threadWait){return -1;}
-  memset(threadWait, 0, size);
+  EpochBarrier barrier;
+  if (epoch_barrier_init(&barrier, maxThreads + 1) != 0){
+    queue_destroy(&queue);
+    jobfile_close(&file);
+    return -1;
+  }
 
   pthread_t tid[maxThreads];
+  Arguments arguments[maxThreads];
+
+  int started = 0;
+  for(; started < maxThreads; started++){
+    arguments[started].file = &file;
+    arguments[started].queue = &queue;
+    arguments[started].barrier = &barrier;
+    arguments[started].id = started;
+    arguments[started].result = -1;
+    if(pthread_create(&tid[started], 0, threadFunc, &arguments[started]) != 0){
+      fprintf(stderr, "Error creating thread\n");
+      break;
+    }
+  }
 
-  int keepReading = 1;
-  
-  while(keepReading){
-    keepReading = 1;
-    barrierFound = 0;
-    for(int i = 0; i < maxThreads; i++){
-      Arguments * arguments = malloc(sizeof(struct arguments));
-      if (!arguments) return -1;
-      arguments->fdin = fdin;
-      arguments->fdout = fdout;
-      arguments->id = i;
-      arguments->max_threads = maxThreads;
-      if(pthread_create(&tid[i], 0, threadFunc, arguments) != 0){
-        fprintf(stderr, "Error creating thread\n");
-        return -1;
-      }
+  // The threads already running stop at their first pop
+  int keepReading = started < maxThreads ? -1 : 1;
+  ems_bind_stats(file.stats != NULL ? &file.stats[maxThreads] : NULL);
+
+  while(keepReading == 1){
+    // This thread parses the segment up to the next BARRIER while the workers execute it
+    keepReading = parseCommands(&file, &queue);
+
+    if (keepReading == 1){
+      // Wait for the workers to finish the segment, then all of them start the next one
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      epoch_barrier_wait(&barrier);
+
+      file.barriers++;
+      file.barrierNs += elapsed_ns(&start);
     }
-    for(int i = 0; i < maxThreads; i++){
-      int *result = NULL;
-      if(pthread_join(tid[i], (void **)&result)){
-        fprintf(stderr, "Error joining thread\n");
-        return -1;
-      }
-      if(keepReading != 0)
-        keepReading = *result;
-      
-      free(result);
+  }
+
+  ems_bind_stats(NULL);
+
+  // Stops the workers if reading failed, or if a worker did, in which case it already aborted the queue
+  if (keepReading != 0){
+    queue_abort(&queue);
+    epoch_barrier_leave(&barrier, 1);
+  }
+
+  int result = keepReading == 0 ? 0 : -1;
+  for(int i = 0; i < started; i++){
+    if(pthread_join(tid[i], NULL)){
+      fprintf(stderr, "Error joining thread\n");
+      result = -1;
     }
+    if(arguments[i].result == -1) result = -1;
   }
 
-  free(threadWait);
-  close(fdin);
-  close(fdout);
-  return 0;
+  epoch_barrier_destroy(&barrier);
+  queue_destroy(&queue);
+  jobfile_close(&file);
+  return result;
 }
 
 void * threadFunc(void* arguments){
   Arguments * parsedArguments = (Arguments*) arguments;
-  int fdIn = parsedArguments->fdin;
-  int fdOut = parsedArguments->fdout;
-  int threadID = parsedArguments->id;
-  int max_Threads = parsedArguments->max_threads;
-  free(parsedArguments);
-  int * res = malloc(sizeof(int));
-  if (!res) return NULL;
+  JobFile *file = parsedArguments->file;
+  ems_bind_stats(file->stats != NULL ? &file->stats[parsedArguments->id] : NULL);
 
   while(1){
-    *res = switchCase(fdIn, fdOut, threadID,max_Threads);
-    if(*res == 0 || *res == 1)
+    parsedArguments->result = switchCase(parsedArguments->file, parsedArguments->queue, parsedArguments->id);
+    if(parsedArguments->result == 0)
+      break;
+    if(parsedArguments->result == -1){
+      // Stops the reader and the other workers, none of them waits for this thread at a barrier again
+      fprintf(stderr, "Failed to read the next command of %s\n", file->name);
+      queue_abort(parsedArguments->queue);
+      epoch_barrier_leave(parsedArguments->barrier, 1);
       break;
+    }
+    if(parsedArguments->result == 1)
+      epoch_barrier_wait(parsedArguments->barrier);
   }
 
-  pthread_exit(res);
+  ems_flush_cache_stats();
+  ems_bind_stats(NULL);
+  return NULL;
 }
 
-int switchCase(int fdIn, int fdOut, int threadID,int max_Threads){
-  unsigned int event_id, delay, thread_id;
-  size_t num_rows, num_columns, num_coords;
-  size_t xs[MAX_RESERVATION_SIZE], ys[MAX_RESERVATION_SIZE];
+/// Decides in how many parts a SHOW is rendered, from the size of its event when the SHOW is parsed.
+/// @note An event created by a command that has not run yet is shown by a single worker.
+/// @param file File the SHOW belongs to.
+/// @param event_id Id of the event to show.
+/// @return Number of parts, 1 not to split the SHOW.
+static size_t show_num_parts(JobFile *file, unsigned int event_id){
+  struct EmsState *state = file->state != NULL ? file->state : &default_state;
+  struct Event *event = get_event(state->event_list, event_id);
+  if (event == NULL) return 1;
+
+  size_t parts = event->rows * event->cols / SHOW_PART_SEATS;
+  if (parts > (size_t)file->max_threads) parts = (size_t)file->max_threads;
+  if (parts > event->rows) parts = event->rows;
+  return parts > 0 ? parts : 1;
+}
 
-  if(pthread_rwlock_wrlock(&waitCommandLock)!=0){return -1;}
-  if(threadWait[threadID]!=0){
-    ems_wait(threadWait[threadID]);
-    threadWait[threadID]=0;
+enum Command parse_command(JobFile *file, struct CommandRecord *record){
+  int fdIn = file->fdin;
+
+  struct timespec start;
+  if (thread_stats != NULL)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // The parts of a split SHOW are handed out one after the other, before anything else is read
+  if (file->pendingShow != NULL){
+    record->cmd = CMD_SHOW;
+    record->event_id = file->pendingShow->event_id;
+    record->show = file->pendingShow;
+    record->part = file->nextPart++;
+    record->seq = file->nextSeq++;
+    if (file->nextPart == file->pendingShow->num_parts)
+      file->pendingShow = NULL;
+    return CMD_SHOW;
   }
-  if(pthread_rwlock_unlock(&waitCommandLock)!=0){return -1;}
 
-  if(pthread_mutex_lock(&parseMutex)!=0){return -1;}
+  while(1){
+    if (file->compiled.mapping != NULL) {
+      // Compiled files come parsed already, only the lines that did not compile are left to report
+      if (compiled_next(&file->compiled, record) == CMD_INVALID) {
+        fprintf(stderr, "Invalid command. See HELP for usage\n");
+        continue;
+      }
+      if (record->cmd == CMD_RESERVE_BATCH) {
+        for (size_t i = 0; i < record->batch->num_requests; i++) {
+          if (record->batch->requests[i].num_seats == 0) fprintf(stderr, "Invalid command. See HELP for usage\n");
+        }
+      }
+    } else {
+      record->cmd = get_next(fdIn);
+
+      switch (record->cmd) {
+        case CMD_CREATE:
+          if (parse_create(fdIn, &record->event_id, &record->num_rows, &record->num_cols) != 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+          break;
+
+        case CMD_RESERVE:
+          record->num_coords = parse_reserve(fdIn, MAX_RESERVATION_SIZE, &record->event_id, record->xs, record->ys);
+          if (record->num_coords == 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+          break;
+
+        case CMD_RESERVE_BEST:
+          if (parse_reserve_best(fdIn, &record->event_id, &record->num_coords) != 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+          break;
+
+        case CMD_RESERVE_BATCH: {
+          size_t count;
+          if (parse_reserve_batch(fdIn, &record->event_id, &count) != 0 || count == 0 || count > MAX_BATCH_REQUESTS) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+          record->batch = reserve_batch_alloc(count);
+          if (record->batch == NULL) {
+            fprintf(stderr, "Error allocating memory for the batch\n");
+            continue;
+          }
+
+          // The requests follow one per line, a line that does not parse only fails its own request
+          for (size_t i = 0; i < count; i++) {
+            size_t num_seats = parse_seats(fdIn, MAX_RESERVATION_SIZE, record->xs, record->ys);
+            if (num_seats == 0)
+              fprintf(stderr, "Invalid command. See HELP for usage\n");
+            else if (reserve_batch_set(record->batch, i, num_seats, record->xs, record->ys) != 0)
+              fprintf(stderr, "Error allocating memory for the batch\n");
+          }
+          break;
+        }
+
+        case CMD_SHOW:
+          if (parse_show(fdIn, &record->event_id) != 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+          break;
+
+        case CMD_SNAPSHOT:
+          if (parse_snapshot(fdIn, record->path, sizeof(record->path)) != 0) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+          break;
+
+        case CMD_WAIT: {
+          int hasThread = parse_wait(fdIn, &record->delay, &record->thread_id);
+          if (hasThread == -1) {
+            fprintf(stderr, "Invalid command. See HELP for usage\n");
+            continue;
+          }
+          if (hasThread == 0)
+            record->thread_id = 0;
+          break;
+        }
+
+        case CMD_INVALID:
+          fprintf(stderr, "Invalid command. See HELP for usage\n");
+          continue;
 
-  if(barrierFound){
-    if(pthread_mutex_unlock(&parseMutex)!=0){return -1;}
-    return 1;
+        case CMD_EMPTY:
+          continue;
+
+        case CMD_LIST_EVENTS:
+        case CMD_HELP:
+        case CMD_BARRIER:
+        case EOC:
+          break;
+      }
+    }
+
+    // Outputs are written in the order their commands are read
+    if (record->cmd == CMD_SHOW || record->cmd == CMD_LIST_EVENTS)
+      record->seq = file->nextSeq++;
+
+    // A large event is split by rows, each part gets the next sequence number so they are written in order
+    if (record->cmd == CMD_SHOW){
+      size_t parts = show_num_parts(file, record->event_id);
+      record->show = parts > 1 ? show_parts_alloc(record->event_id, parts) : NULL;
+      record->part = 0;
+      if (record->show != NULL){
+        file->pendingShow = record->show;
+        file->nextPart = 1;
+      }
+    }
+
+    if (thread_stats != NULL)
+      latency_record(&thread_stats->parse, (unsigned long)elapsed_ns(&start));
+
+    return record->cmd;
   }
+}
 
-  switch (get_next(fdIn)) {
-    case CMD_CREATE:
-      if (parse_create(fdIn, &event_id, &num_rows, &num_columns) != 0) {
-        fprintf(stderr, "Invalid command. See HELP for usage\n");
-        return -1;
+int parseCommands(JobFile *file, struct CommandQueue * queue){
+  struct CommandRecord record;
+
+  while(1){
+    enum Command cmd = parse_command(file, &record);
+
+    if (cmd == CMD_BARRIER || cmd == EOC) {
+      // One end of segment marker per worker, each worker stops at the first one it pops
+      for (int i = 0; i < file->max_threads; i++) {
+        if (queue_push(queue, &record) != 0) return -1;
+      }
+      return cmd == CMD_BARRIER;
+    }
+
+    if (queue_push(queue, &record) != 0) {
+      record.cmd = EOC;
+      for (int i = 0; i < file->max_threads; i++) {
+        queue_push(queue, &record);
       }
+      return -1;
+    }
+
+    // A WAIT for a specific thread must be applied before any later command is handed out
+    if (cmd == CMD_WAIT && record.thread_id != 0)
+      queue_wait_fence(queue);
+  }
+}
+
+void wait_if_requested(JobFile *file, int threadID){
+  pthread_mutex_lock(&file->waitLock);
+  unsigned int delay = file->threadWait[threadID];
+  file->threadWait[threadID] = 0;
+  pthread_mutex_unlock(&file->waitLock);
+
+  if (delay != 0)
+    ems_wait(delay);
+}
+
+/// Gets the statistics slot of a command.
+/// @param cmd Command that is executed.
+/// @return Index of its latency histogram, STAT_COMMANDS if it is not timed.
+static enum StatCommand stat_command(enum Command cmd) {
+  switch (cmd) {
+    case CMD_CREATE: return STAT_CREATE;
+    case CMD_RESERVE: return STAT_RESERVE;
+    case CMD_RESERVE_BEST: return STAT_RESERVE_BEST;
+    case CMD_RESERVE_BATCH: return STAT_RESERVE_BATCH;
+    case CMD_SHOW: return STAT_SHOW;
+    case CMD_SNAPSHOT: return STAT_SNAPSHOT;
+    case CMD_LIST_EVENTS: return STAT_LIST;
+    case CMD_WAIT: return STAT_WAIT;
+    case CMD_HELP: return STAT_HELP;
+    case CMD_BARRIER:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+      break;
+  }
+  return STAT_COMMANDS;
+}
 
-      if(pthread_mutex_unlock(&parseMutex)!=0){return -1;}
+void execute_command(JobFile *file, struct CommandRecord *record){
+  unsigned int thread_id = record->thread_id;
+  struct OutBuffer output;
+  outbuf_init(&output);
 
-      if (ems_create(event_id, num_rows, num_columns)) {
+  struct timespec start;
+  if (thread_stats != NULL)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+  switch (record->cmd) {
+    case CMD_CREATE:
+      if (ems_create(record->event_id, record->num_rows, record->num_cols)) {
         fprintf(stderr, "Failed to create event\n");
       }
 
       break;
 
     case CMD_RESERVE:
-      num_coords = parse_reserve(fdIn, MAX_RESERVATION_SIZE, &event_id, xs, ys);
-
-      if (num_coords == 0) {
-        fprintf(stderr, "Invalid command. See HELP for usage\n");
-        return -1;
+      if (ems_reserve(record->event_id, record->num_coords, record->xs, record->ys)) {
+        fprintf(stderr, "Failed to reserve seats\n");
       }
 
-      if(pthread_mutex_unlock(&parseMutex)!=0){return -1;}
+      break;
 
-      if (ems_reserve(event_id, num_coords, xs, ys)) {
+    case CMD_RESERVE_BEST:
+      if (ems_reserve_best(record->event_id, record->num_coords)) {
         fprintf(stderr, "Failed to reserve seats\n");
       }
 
       break;
 
-    case CMD_SHOW:
-      if (parse_show(fdIn, &event_id) != 0) {
-        fprintf(stderr, "Invalid command. See HELP for usage\n");
-        return -1;
+    case CMD_RESERVE_BATCH:
+      ems_reserve_batch(record->event_id, record->batch->num_requests, record->batch->requests, record->batch->results);
+      for (size_t i = 0; i < record->batch->num_requests; i++) {
+        if (record->batch->results[i] != 0) fprintf(stderr, "Failed to reserve seats\n");
       }
-      if(pthread_mutex_unlock(&parseMutex)!=0){return -1;}
+      reserve_batch_free(record->batch);
+      record->batch = NULL;
 
-      if (ems_show(event_id, fdOut)) {
+      break;
+
+    case CMD_SHOW:
+      // Failed commands still commit an empty output, the ones after them wait for it
+      if (record->show != NULL ? ems_show_part(record->show, record->part, &output)
+                               : ems_show_to(record->event_id, &output)) {
         fprintf(stderr, "Failed to show event\n");
+        output.len = 0;
       }
+      outseq_commit(&file->output, record->seq, &output);
+      if (record->show != NULL) show_parts_done(record->show);
 
       break;
 
-    case CMD_LIST_EVENTS:
-      if(pthread_mutex_unlock(&parseMutex)!=0){return -1;}
-
-      if (ems_list_events(fdOut)) {
-        fprintf(stderr, "Failed to list events\n");
+    case CMD_SNAPSHOT:
+      if (ems_snapshot(record->path)) {
+        fprintf(stderr, "Failed to write snapshot\n");
       }
 
       break;
 
-    case CMD_WAIT:
-      if (parse_wait(fdIn, &delay, &thread_id) == -1) {
-        fprintf(stderr, "Invalid command. See HELP for usage\n");
-        return -1;
+    case CMD_LIST_EVENTS:
+      if (ems_list_events_to(&output, &file->output, record->seq)) {
+        fprintf(stderr, "Failed to list events\n");
+        output.len = 0;
       }
+      outseq_commit(&file->output, record->seq, &output);
 
-      if(pthread_mutex_unlock(&parseMutex)!=0){return -1;}
+      break;
 
-      if (delay > 0) {
+    case CMD_WAIT:
+      if (record->delay > 0) {
         printf("Waiting...\n");
         
         if(thread_id==0)
-          ems_wait(delay);
-        else if (thread_id>0 && thread_id<(unsigned int) max_Threads){
-          if(pthread_rwlock_wrlock(&waitCommandLock)!=0){return -1;}
-          threadWait[--thread_id] = delay;
-          if(pthread_rwlock_unlock(&waitCommandLock)!=0){return -1;}
+          ems_wait(record->delay);
+        else if (thread_id>0 && thread_id<(unsigned int) file->max_threads){
+          pthread_mutex_lock(&file->waitLock);
+          file->threadWait[--thread_id] = record->delay;
+          pthread_mutex_unlock(&file->waitLock);
         }
       }
       break;
 
-    case CMD_INVALID:
-      fprintf(stderr, "Invalid command. See HELP for usage\n");
-      break;
-
     case CMD_HELP:
-      if(pthread_mutex_unlock(&parseMutex)!=0){return -1;}
       printf(
           "Available commands:\n"
           "  CREATE <event_id> <num_rows> <num_columns>\n"
           "  RESERVE <event_id> [(<x1>,<y1>) (<x2>,<y2>) ...]\n"
+          "  RESERVE_BEST <event_id> <num_seats>\n"
+          "  RESERVE_BATCH <event_id> <num_requests>, then one [(<x1>,<y1>) (<x2>,<y2>) ...] per request\n"
           "  SHOW <event_id>\n"
+          "  SNAPSHOT <path>\n"
           "  LIST\n"
           "  WAIT <delay_ms> [thread_id]\n"  // thread_id is not implemented
           "  BARRIER\n"                      // Not implemented
@@ -519,18 +1889,35 @@ int switchCase(int fdIn, int fdOut, int threadID,int max_Threads){
       break;
 
     case CMD_BARRIER:
-      barrierFound = 1;
-      if(pthread_mutex_unlock(&parseMutex)!=0){return -1;}
-      return 1;
+    case EOC:
+    case CMD_INVALID:
     case CMD_EMPTY:
-      if(pthread_mutex_unlock(&parseMutex)!=0){return -1;}
+      // Segment boundaries are handled by the caller, the rest is never parsed into a record
       break;
-
-    case EOC:
-      if(pthread_mutex_unlock(&parseMutex)!=0){return -1;}
-      return 0;
   }
 
-  return 2;
+  outbuf_free(&output);
+
+  if (thread_stats != NULL && stat_command(record->cmd) != STAT_COMMANDS)
+    latency_record(&thread_stats->commands[stat_command(record->cmd)], (unsigned long)elapsed_ns(&start));
 }
 
+int switchCase(JobFile *file, struct CommandQueue * queue, int threadID){
+  struct CommandRecord record;
+
+  wait_if_requested(file, threadID);
+
+  if (queue_pop(queue, &record) != 0){return -1;}
+
+  if (record.cmd == CMD_BARRIER)
+    return 1;
+  if (record.cmd == EOC)
+    return 0;
+
+  execute_command(file, &record);
+
+  if (record.cmd == CMD_WAIT && record.thread_id != 0)
+    queue_signal_fence(queue);
+
+  return 2;
+}
@@ -3,11 +3,118 @@
 
 #include <stddef.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
+#include "commandqueue.h"
+#include "compiled.h"
+#include "outbuffer.h"
+#include "stats.h"
+#include "wal.h"
+
+// Barrier reused across segments, each crossing starts a new epoch
+typedef struct epochBarrier{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int parties, arrived;
+    unsigned long epoch;
+} EpochBarrier;
+
+// EMS state. Job files run in the same process each get their own.
+struct EmsState {
+  struct EventList *event_list;
+  unsigned long generation;  // Tags the event cache entries of this state, unique per state
+  _Atomic unsigned long cache_hits;    // Event cache counters flushed by the threads
+  _Atomic unsigned long cache_misses;
+  struct WriteAheadLog *wal;  // Log the successful CREATE and RESERVE commands are made durable in, NULL if off
+  pthread_mutex_t createLock;  // Held by a logged CREATE from its check for the event until it is in the list
+};
+
+// A job file being run, shared by every thread working on it
+typedef struct jobFile{
+    char *name;              // File name, without the directory
+    int fdin, fdout;
+    struct CompiledJobs compiled;  // Mapping of fdin if it is a compiled job file, mapping is NULL otherwise
+    int max_threads;
+    struct EmsState *state;  // State its commands run against, NULL for the state of ems_init
+    unsigned int *threadWait;  // List of time for each thread to wait before executing
+    pthread_mutex_t waitLock;  // Lock for threadWait
+    unsigned long nextSeq;     // Sequence number of the next output, taken when a command is parsed
+    struct ShowParts *pendingShow;  // SHOW whose parts are still being handed out, NULL if none
+    size_t nextPart;                // Next part of pendingShow to hand out
+    struct OutSequencer output;  // Writes the outputs to fdout in command order
+    struct ThreadStats *stats;  // One slot per thread id plus one for the reader, NULL unless stats are on
+    int fdstats;               // File the stats are written to, -1 unless they are on
+    struct timespec opened;    // When the file was opened
+    unsigned long barriers;    // Barriers crossed so far
+    long barrierNs;            // Time spent waiting for the threads at those barriers
+    struct WriteAheadLog *wal;  // Reservation log of the file, NULL unless logging is on
+} JobFile;
+
+// Per thread state, lives for the whole file
 typedef struct arguments{
-    int fdin, fdout, id,max_threads;
+    JobFile *file;
+    struct CommandQueue *queue;
+    EpochBarrier *barrier;
+    int id;
+    int result;
 } Arguments;
 
+// How ems_reserve claims seats
+enum ReserveMode {
+  RESERVE_LOCKS,  // Write-lock the rows of the seats, then check and set them
+  RESERVE_CAS     // Compare-and-swap each seat from 0, rolling back on conflict
+};
+
+/// Selects how reservations claim seats. Must be called before any event is used.
+/// @param mode Reservation engine to use.
+void ems_set_reserve_mode(enum ReserveMode mode);
+
+/// Makes every job file opened from now on collect statistics and write them to a .stats file.
+/// @param enabled 1 to collect statistics, 0 not to.
+void ems_set_stats(int enabled);
+
+/// Makes every job file opened from now on log its successful CREATE and RESERVE commands to a .wal file.
+/// @note A command returns only once its record is durable, records are written in batches by a flusher thread.
+/// An event created is only found by other commands once its CREATE is durable.
+/// @param enabled 1 to log, 0 not to.
+/// @param interval_us Time a batch waits for more records once its first one arrives.
+void ems_set_wal(int enabled, unsigned int interval_us);
+
+/// Makes every state initialized from now on replay a reservation log, after loading the snapshot if any.
+/// @param path Path of the log, must stay valid while states are initialized. NULL not to replay any.
+void ems_set_recover(const char *path);
+
+/// Makes the calling thread record its statistics in the given slot.
+/// @param stats Slot owned by the calling thread, NULL to stop recording.
+void ems_bind_stats(struct ThreadStats *stats);
+
+/// Adds the event cache counters of the calling thread to its state and resets them.
+void ems_flush_cache_stats();
+
+/// Gets the event cache counters flushed so far.
+/// @param state State to get the counters of, NULL for the state of ems_init.
+/// @param hits Where to store the number of lookups served by the cache.
+/// @param misses Where to store the number of lookups that went to the event list.
+void ems_cache_stats(struct EmsState *state, unsigned long *hits, unsigned long *misses);
+
+/// Makes every state initialized from now on start with the events of a snapshot.
+/// @param path Path of the snapshot, must stay valid while states are initialized. NULL to start empty.
+void ems_set_snapshot(const char *path);
+
+/// Initializes an EMS state, independent of the one of ems_init.
+/// @param state State to initialize.
+/// @return 0 if the state was initialized successfully, 1 otherwise.
+int ems_state_init(struct EmsState *state);
+
+/// Destroys a state initialized with ems_state_init.
+/// @param state State to destroy, no thread may still be bound to it.
+void ems_state_destroy(struct EmsState *state);
+
+/// Makes the ems_* operations of the calling thread use the given state.
+/// @param state State to use, NULL for the state of ems_init.
+void ems_bind_state(struct EmsState *state);
+
 /// Writes to file.
 /// @param fd File descriptor of the file to write to
 /// @param buffer String to write
@@ -37,19 +144,74 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols);
 /// @return 0 if the reservation was created successfully, 1 otherwise.
 int ems_reserve(unsigned int event_id, size_t num_seats, size_t *xs, size_t *ys);
 
-/// Prints the given event.
-/// @param event_id Id of the event to print.
-/// @return 0 if the event was printed successfully, 1 otherwise.
-int ems_show(unsigned int event_id, int fd);
+/// Reserves the best contiguous run of free seats in a row of the given event.
+/// @note The best run is the leftmost one in the frontmost row that has one long enough.
+/// @param event_id Id of the event to create a reservation for.
+/// @param count Number of seats to reserve, at most MAX_RESERVATION_SIZE.
+/// @return 0 if the reservation was created successfully, 1 otherwise.
+int ems_reserve_best(unsigned int event_id, size_t count);
+
+/// Reserves many sets of seats of one event, each one all or nothing.
+/// @note The event is looked up once, every seat lock the batch needs is taken once and each page of seats
+/// is accessed once, however many requests touch it. Requests are applied in order, so one only fails on
+/// seats taken before it, and get reservation ids in that order.
+/// @param event_id Id of the event to create the reservations for.
+/// @param num_requests Number of requests.
+/// @param requests Seats of each request.
+/// @param results Where to store the result of each request, 0 if it was reserved and 1 otherwise.
+/// @return 0 if every request was reserved, 1 otherwise.
+int ems_reserve_batch(unsigned int event_id, size_t num_requests, const struct ReserveRequest *requests, int *results);
+
+/// Renders the given event.
+/// @param event_id Id of the event to render.
+/// @param buffer Buffer to append the rendering to.
+/// @return 0 if the event was rendered successfully, 1 otherwise.
+int ems_show_to(unsigned int event_id, struct OutBuffer *buffer);
+
+/// Renders one part of a SHOW split by rows, see struct ShowParts.
+/// @note The first part to run holds the seats while the parts running meanwhile copy them a row range each,
+/// then every part renders its rows from the copy without locks, in parallel with the others.
+/// @param show Parts of the SHOW.
+/// @param part Index of the part to render.
+/// @param buffer Buffer to append the rows of the part to.
+/// @return 0 if the part was rendered or the copy failed in another part, 1 otherwise.
+int ems_show_part(struct ShowParts *show, size_t part, struct OutBuffer *buffer);
+
+/// Renders all the events.
+/// @param buffer Buffer to append the rendering to.
+/// @param output Sequencer every LIST_CHUNK_SIZE bytes of the rendering are streamed to, NULL to keep it all in
+/// the buffer. What is left in the buffer is for the caller to commit.
+/// @param seq Sequence number of the LIST in output.
+/// @return 0 if the events were rendered successfully, 1 otherwise.
+int ems_list_events_to(struct OutBuffer *buffer, struct OutSequencer *output, unsigned long seq);
 
-/// Prints all the events.
-/// @return 0 if the events were printed successfully, 1 otherwise.
-int ems_list_events(int fd);
+/// Writes every event to a snapshot file that --snapshot can start from.
+/// @param path Path of the snapshot, replaced only once the new one is complete.
+/// @return 0 if the snapshot was written successfully, 1 otherwise.
+int ems_snapshot(const char *path);
 
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
 void ems_wait(unsigned int delay_ms);
 
+/// Opens a job file and its output file.
+/// @param file Job file to initialize.
+/// @param dirPath the path to the dir.
+/// @param filename name of the file to open, must outlive the job file.
+/// @param maxThreads number of threads that will work on the file.
+/// @param state state the commands run against, NULL for the state of ems_init.
+/// @return 0 if all went sucessfully, -1 otherwise.
+int jobfile_open(JobFile *file, char *dirPath, char *filename, int maxThreads, struct EmsState *state);
+
+/// Writes the .stats file of a job file if enabled and closes it.
+/// @param file Job file to close.
+void jobfile_close(JobFile *file);
+
+/// Gets the time elapsed since a point in time.
+/// @param start Time taken from CLOCK_MONOTONIC.
+/// @return Nanoseconds elapsed since start.
+long elapsed_ns(struct timespec *start);
+
 /// read all the .job files.
 /// @param dirpath the path to the dir.
 /// @param filename name of the file to open.
@@ -57,16 +219,38 @@ void ems_wait(unsigned int delay_ms);
 /// @return 0 if all went sucessfully, 1 otherwise.
 int ems_file(char * dirpath,char *filename, int maxThreads);
 
-/// Compute a line of a file
-/// @param fdin file descriptor of the file to read from.
-/// @param fdout file descriptor of the file to write to
+/// Parses the next command of a file, skipping empty lines and reporting invalid ones.
+/// @param file file to read from.
+/// @param record where to store the parsed command.
+/// @return the command parsed, EOC at the end of the file.
+enum Command parse_command(JobFile *file, struct CommandRecord *record);
+
+/// Parses a file up to the next BARRIER or its end, pushing the commands to the queue.
+/// @param file file to read from.
+/// @param queue queue the workers pop the commands from, each worker gets one end of segment marker.
+/// @return 0 if EOF, 1 if Barrier found, -1 on error
+int parseCommands(JobFile *file, struct CommandQueue *queue);
+
+/// Sleeps for the time a WAIT command asked the given thread to wait, if any.
+/// @param file file the thread is working on.
+/// @param threadID id of the thread in the file.
+void wait_if_requested(JobFile *file, int threadID);
+
+/// Executes a parsed command other than BARRIER.
+/// @param file file the command belongs to.
+/// @param record command to execute.
+void execute_command(JobFile *file, struct CommandRecord *record);
+
+/// Executes the next command of the queue
+/// @param file file the queue belongs to.
+/// @param queue queue to pop the command from.
 /// @param threadID id of the current thread
-/// @return 0 if EOF, 1 if Barrier found and 2 if another command was found
-int switchCase(int fdIn, int fdOut, int threadID,int max_Threads);
+/// @return 0 if EOF, 1 if Barrier found, 2 if another command was found and -1 if no command could be popped
+int switchCase(JobFile *file, struct CommandQueue *queue, int threadID);
 
-/// Main function of a thread
-/// @param arguments arguments of each thread.
-/// @return 0 if EOF, 1 if Barrier found
+/// Main function of a thread, runs every segment of the file
+/// @param arguments arguments of each thread, result is set to 0 on EOF and to -1 if the thread failed.
+/// @return NULL
 void * threadFunc(void* arguments);
 
 #endif  // EMS_OPERATIONS_H
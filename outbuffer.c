@@ -0,0 +1,316 @@
+#include "outbuffer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "constants.h"
+
+#define OUT_BUFFER_MIN_CAPACITY 4096
+
+// Two digit decimal strings of 00 to 99, used to convert numbers two digits at a time
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+void outbuf_init(struct OutBuffer *buffer) {
+  buffer->data = NULL;
+  buffer->len = 0;
+  buffer->cap = 0;
+}
+
+void outbuf_free(struct OutBuffer *buffer) {
+  free(buffer->data);
+  outbuf_init(buffer);
+}
+
+int outbuf_reserve(struct OutBuffer *buffer, size_t extra) {
+  if (buffer->cap - buffer->len >= extra) return 0;
+
+  size_t cap = buffer->cap ? buffer->cap : OUT_BUFFER_MIN_CAPACITY;
+  while (cap - buffer->len < extra) {
+    if (cap > (size_t)-1 / 2) return 1;
+    cap *= 2;
+  }
+
+  char *data = realloc(buffer->data, cap);
+  if (!data) return 1;
+
+  buffer->data = data;
+  buffer->cap = cap;
+  return 0;
+}
+
+int outbuf_put(struct OutBuffer *buffer, const char *data, size_t len) {
+  if (outbuf_reserve(buffer, len) != 0) return 1;
+
+  memcpy(buffer->data + buffer->len, data, len);
+  buffer->len += len;
+  return 0;
+}
+
+int outbuf_put_char(struct OutBuffer *buffer, char ch) {
+  if (buffer->len == buffer->cap && outbuf_reserve(buffer, 1) != 0) return 1;
+
+  buffer->data[buffer->len++] = ch;
+  return 0;
+}
+
+size_t uint_digits(unsigned int value) {
+  size_t digits = 1;
+  while (value >= 10) {
+    value /= 10;
+    digits++;
+  }
+  return digits;
+}
+
+int outbuf_put_uint(struct OutBuffer *buffer, unsigned int value) {
+  // Small values are by far the most common in SHOW
+  if (value < 10) return outbuf_put_char(buffer, (char)('0' + value));
+
+  size_t digits = uint_digits(value);
+  if (outbuf_reserve(buffer, digits) != 0) return 1;
+
+  char *end = buffer->data + buffer->len + digits;
+  while (value >= 100) {
+    unsigned int pair = (value % 100) * 2;
+    value /= 100;
+    *--end = digit_pairs[pair + 1];
+    *--end = digit_pairs[pair];
+  }
+  if (value >= 10) {
+    *--end = digit_pairs[value * 2 + 1];
+    *--end = digit_pairs[value * 2];
+  } else {
+    *--end = (char)('0' + value);
+  }
+
+  buffer->len += digits;
+  return 0;
+}
+
+int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t bytes_written = write(fd, data, len);
+    if (bytes_written < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "write error: %s\n", strerror(errno));
+      return 1;
+    }
+
+    data += bytes_written;
+    len -= (size_t)bytes_written;
+  }
+  return 0;
+}
+
+int outbuf_flush(struct OutBuffer *buffer, int fd) {
+  int result = write_all(fd, buffer->data, buffer->len);
+  buffer->len = 0;
+  return result;
+}
+
+int outseq_init(struct OutSequencer *sequencer, int fd) {
+  sequencer->fd = fd;
+  sequencer->error = 0;
+  sequencer->written = 0;
+  sequencer->ready = 0;
+  sequencer->readyBytes = 0;
+  sequencer->capacity = OUTPUT_COMMIT_IOVS;
+  sequencer->slots = malloc(sequencer->capacity * sizeof(struct OutBuffer));
+  sequencer->filled = calloc(sequencer->capacity, sizeof(char));
+
+  if (!sequencer->slots || !sequencer->filled || pthread_mutex_init(&sequencer->lock, NULL) != 0) {
+    free(sequencer->slots);
+    free(sequencer->filled);
+    return 1;
+  }
+  return 0;
+}
+
+/// Doubles the slots of a sequencer, keeping every output at the slot of its number.
+/// @return 0 if the slots were grown, 1 otherwise.
+static int outseq_grow(struct OutSequencer *sequencer) {
+  size_t capacity = sequencer->capacity * 2;
+  struct OutBuffer *slots = malloc(capacity * sizeof(struct OutBuffer));
+  char *filled = calloc(capacity, sizeof(char));
+  if (!slots || !filled) {
+    free(slots);
+    free(filled);
+    return 1;
+  }
+
+  for (unsigned long n = sequencer->written; n < sequencer->written + sequencer->capacity; n++) {
+    size_t from = n & (sequencer->capacity - 1), to = n & (capacity - 1);
+    slots[to] = sequencer->slots[from];
+    filled[to] = sequencer->filled[from];
+  }
+
+  free(sequencer->slots);
+  free(sequencer->filled);
+  sequencer->slots = slots;
+  sequencer->filled = filled;
+  sequencer->capacity = capacity;
+  return 0;
+}
+
+/// Writes the outputs that are in order, a writev at a time.
+/// @note Called with the sequencer lock held.
+static void outseq_write_ready(struct OutSequencer *sequencer) {
+  struct iovec iov[OUTPUT_COMMIT_IOVS];
+
+  while (sequencer->written < sequencer->ready) {
+    unsigned long end = sequencer->written;
+    int count = 0;
+    for (; end < sequencer->ready && count < OUTPUT_COMMIT_IOVS; end++) {
+      struct OutBuffer *output = &sequencer->slots[end & (sequencer->capacity - 1)];
+      if (output->len == 0) continue;
+      iov[count].iov_base = output->data;
+      iov[count].iov_len = output->len;
+      count++;
+    }
+
+    // Partial writes resume from the first byte left, in whichever output it falls
+    struct iovec *next = iov;
+    while (count > 0 && !sequencer->error) {
+      ssize_t bytes = writev(sequencer->fd, next, count);
+      if (bytes < 0) {
+        if (errno == EINTR) continue;
+        fprintf(stderr, "write error: %s\n", strerror(errno));
+        sequencer->error = 1;
+        break;
+      }
+
+      size_t left = (size_t)bytes;
+      while (count > 0 && left >= next->iov_len) {
+        left -= next->iov_len;
+        next++;
+        count--;
+      }
+      if (count > 0) {
+        next->iov_base = (char *)next->iov_base + left;
+        next->iov_len -= left;
+      }
+    }
+
+    for (; sequencer->written < end; sequencer->written++) {
+      size_t slot = sequencer->written & (sequencer->capacity - 1);
+      sequencer->readyBytes -= sequencer->slots[slot].len;
+      outbuf_free(&sequencer->slots[slot]);
+      sequencer->filled[slot] = OUTPUT_EMPTY;
+    }
+  }
+}
+
+/// Grows the slots of a sequencer until they reach an output.
+/// @note Called with the sequencer lock held.
+/// @return 0 if the output has a slot, 1 if the memory could not be allocated and the sequencer failed.
+static int outseq_make_room(struct OutSequencer *sequencer, unsigned long number) {
+  while (number - sequencer->written >= sequencer->capacity) {
+    if (outseq_grow(sequencer) != 0) {
+      // The output can not wait for its turn, so the ones after it would never be written
+      fprintf(stderr, "Error allocating memory for output\n");
+      sequencer->error = 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int outseq_stream(struct OutSequencer *sequencer, unsigned long number, struct OutBuffer *buffer) {
+  pthread_mutex_lock(&sequencer->lock);
+  if (outseq_make_room(sequencer, number) != 0) {
+    pthread_mutex_unlock(&sequencer->lock);
+    outbuf_free(buffer);
+    return 1;
+  }
+
+  size_t slot = number & (sequencer->capacity - 1);
+  if (sequencer->ready == number) {
+    // Its turn, so whatever was kept of it and the chunk go straight to the file
+    outseq_write_ready(sequencer);
+    if (sequencer->filled[slot] == OUTPUT_PARTIAL) {
+      if (!sequencer->error) sequencer->error = outbuf_flush(&sequencer->slots[slot], sequencer->fd);
+      outbuf_free(&sequencer->slots[slot]);
+      sequencer->filled[slot] = OUTPUT_EMPTY;
+    }
+    if (!sequencer->error) sequencer->error = outbuf_flush(buffer, sequencer->fd);
+    buffer->len = 0;
+  } else {
+    if (sequencer->filled[slot] != OUTPUT_PARTIAL) {
+      outbuf_init(&sequencer->slots[slot]);
+      sequencer->filled[slot] = OUTPUT_PARTIAL;
+    }
+    if (outbuf_put(&sequencer->slots[slot], buffer->data, buffer->len) != 0) {
+      fprintf(stderr, "Error allocating memory for output\n");
+      sequencer->error = 1;
+    }
+    buffer->len = 0;
+  }
+
+  int result = sequencer->error;
+  pthread_mutex_unlock(&sequencer->lock);
+  return result;
+}
+
+int outseq_commit(struct OutSequencer *sequencer, unsigned long number, struct OutBuffer *buffer) {
+  pthread_mutex_lock(&sequencer->lock);
+  if (outseq_make_room(sequencer, number) != 0) {
+    pthread_mutex_unlock(&sequencer->lock);
+    outbuf_free(buffer);
+    return 1;
+  }
+
+  size_t slot = number & (sequencer->capacity - 1);
+  if (sequencer->filled[slot] == OUTPUT_PARTIAL) {
+    // Chunks streamed before its turn come first
+    if (outbuf_put(&sequencer->slots[slot], buffer->data, buffer->len) != 0) {
+      fprintf(stderr, "Error allocating memory for output\n");
+      sequencer->error = 1;
+    }
+    outbuf_free(buffer);
+  } else {
+    sequencer->slots[slot] = *buffer;
+    outbuf_init(buffer);
+  }
+  sequencer->filled[slot] = OUTPUT_COMMITTED;
+
+  while (sequencer->filled[sequencer->ready & (sequencer->capacity - 1)] == OUTPUT_COMMITTED && sequencer->ready - sequencer->written < sequencer->capacity) {
+    sequencer->readyBytes += sequencer->slots[sequencer->ready & (sequencer->capacity - 1)].len;
+    sequencer->ready++;
+  }
+
+  if (sequencer->readyBytes >= OUTPUT_COMMIT_SIZE || sequencer->ready - sequencer->written >= OUTPUT_COMMIT_IOVS)
+    outseq_write_ready(sequencer);
+
+  int result = sequencer->error;
+  pthread_mutex_unlock(&sequencer->lock);
+  return result;
+}
+
+int outseq_destroy(struct OutSequencer *sequencer) {
+  pthread_mutex_lock(&sequencer->lock);
+  outseq_write_ready(sequencer);
+  int result = sequencer->error;
+  pthread_mutex_unlock(&sequencer->lock);
+
+  for (size_t i = 0; i < sequencer->capacity; i++) {
+    if (sequencer->filled[i]) outbuf_free(&sequencer->slots[i]);
+  }
+  free(sequencer->slots);
+  free(sequencer->filled);
+  pthread_mutex_destroy(&sequencer->lock);
+  return result;
+}
@@ -0,0 +1,105 @@
+#ifndef OUT_BUFFER_H
+#define OUT_BUFFER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Growable output buffer, written sequentially through its length
+struct OutBuffer {
+  char *data;
+  size_t len;  // Bytes written so far
+  size_t cap;  // Bytes allocated
+};
+
+/// Initializes an empty buffer, nothing is allocated until the first write.
+/// @param buffer Buffer to initialize.
+void outbuf_init(struct OutBuffer *buffer);
+
+/// Frees the memory of a buffer, leaving it empty.
+/// @param buffer Buffer to free.
+void outbuf_free(struct OutBuffer *buffer);
+
+/// Makes room for at least extra more bytes.
+/// @param buffer Buffer to grow.
+/// @param extra Number of bytes about to be written.
+/// @return 0 if there is enough room, 1 if the memory could not be allocated.
+int outbuf_reserve(struct OutBuffer *buffer, size_t extra);
+
+/// Appends bytes to the buffer.
+/// @param buffer Buffer to write to.
+/// @param data Bytes to append.
+/// @param len Number of bytes to append.
+/// @return 0 if the bytes were appended, 1 otherwise.
+int outbuf_put(struct OutBuffer *buffer, const char *data, size_t len);
+
+/// Appends a single character to the buffer.
+/// @return 0 if the character was appended, 1 otherwise.
+int outbuf_put_char(struct OutBuffer *buffer, char ch);
+
+/// Appends the decimal representation of a number to the buffer.
+/// @return 0 if the number was appended, 1 otherwise.
+int outbuf_put_uint(struct OutBuffer *buffer, unsigned int value);
+
+/// Writes the whole buffer to a file and empties it.
+/// @param buffer Buffer to flush.
+/// @param fd File descriptor of the file to write to.
+/// @return 0 if everything was written, 1 otherwise.
+int outbuf_flush(struct OutBuffer *buffer, int fd);
+
+/// Writes all the bytes to a file, retrying partial writes.
+/// @param fd File descriptor of the file to write to.
+/// @param data Bytes to write.
+/// @param len Number of bytes to write.
+/// @return 0 if everything was written, 1 otherwise.
+int write_all(int fd, const char *data, size_t len);
+
+/// Number of decimal digits of a number.
+/// @param value Number to measure.
+/// @return Number of characters outbuf_put_uint writes for it.
+size_t uint_digits(unsigned int value);
+
+enum OutputSlotState { OUTPUT_EMPTY = 0, OUTPUT_PARTIAL, OUTPUT_COMMITTED };  // PARTIAL holds chunks streamed early
+
+// Writes the outputs of commands to a file in the order of their sequence numbers,
+// whatever the order the threads finish them in
+struct OutSequencer {
+  pthread_mutex_t lock;
+  int fd;
+  int error;                 // Set once a write failed, later outputs are dropped
+  unsigned long written;     // Sequence number of the first output not written yet
+  unsigned long ready;       // Sequence number of the first output missing, everything before it can be written
+  size_t readyBytes;         // Bytes of the outputs from written to ready
+  struct OutBuffer *slots;   // Committed outputs, by sequence number modulo the capacity
+  char *filled;              // OutputSlotState of each slot
+  size_t capacity;           // Power of two
+};
+
+/// Initializes a sequencer, the first output it expects is number 0.
+/// @param sequencer Sequencer to initialize.
+/// @param fd File descriptor of the file to write to.
+/// @return 0 if the sequencer was initialized, 1 otherwise.
+int outseq_init(struct OutSequencer *sequencer, int fd);
+
+/// Hands the output of a command to the sequencer, which writes it once all the ones before it are in.
+/// @note Every sequence number must be committed exactly once, with an empty buffer if the command wrote nothing.
+/// @param sequencer Sequencer of the file.
+/// @param number Sequence number of the command.
+/// @param buffer Output of the command, left empty.
+/// @return 0 if the output was taken, 1 if it could not be or an earlier write failed.
+int outseq_commit(struct OutSequencer *sequencer, unsigned long number, struct OutBuffer *buffer);
+
+/// Hands the output of a command written so far to the sequencer, before the command commits the rest.
+/// @note Written at once if every output before it is, kept until then otherwise, so a long output only stays in
+/// memory while it waits for its turn.
+/// @param sequencer Sequencer of the file.
+/// @param number Sequence number of the command, not committed yet.
+/// @param buffer Chunk of the output, emptied but kept allocated for the next one.
+/// @return 0 if the chunk was taken, 1 if it could not be or an earlier write failed.
+int outseq_stream(struct OutSequencer *sequencer, unsigned long number, struct OutBuffer *buffer);
+
+/// Writes every output that is in order and destroys the sequencer.
+/// @param sequencer Sequencer to destroy.
+/// @return 0 if everything was written, 1 otherwise.
+int outseq_destroy(struct OutSequencer *sequencer);
+
+#endif  // OUT_BUFFER_H
@@ -7,12 +7,84 @@
 
 #include "constants.h"
 
+#define PARSER_BUFFER_SIZE 65536  // Bytes read from the file at a time
+#define PARSER_MAX_FDS 1024       // File descriptors above this are read unbuffered
+
+// Input buffer of a file descriptor. All readers of the fd share it, and through it the file offset.
+struct read_buffer {
+  size_t pos;  // Next byte to consume
+  size_t len;  // Number of valid bytes in data
+  char data[PARSER_BUFFER_SIZE];
+};
+
+static struct read_buffer *buffers[PARSER_MAX_FDS];
+
+/// Reads up to count bytes, refilling the buffer of the fd when it runs out.
+/// @param fd File descriptor to read from.
+/// @param dst Where to copy the bytes to.
+/// @param count Number of bytes to read.
+/// @return Number of bytes read, less than count only at EOF or on error.
+static size_t read_buffered(int fd, char *dst, size_t count) {
+  if (fd < 0 || fd >= PARSER_MAX_FDS) {
+    ssize_t bytes_read = read(fd, dst, count);
+    return bytes_read < 0 ? 0 : (size_t)bytes_read;
+  }
+
+  struct read_buffer *buffer = buffers[fd];
+  if (buffer == NULL) {
+    buffer = malloc(sizeof(struct read_buffer));
+    if (buffer == NULL) {
+      ssize_t bytes_read = read(fd, dst, count);
+      return bytes_read < 0 ? 0 : (size_t)bytes_read;
+    }
+    buffer->pos = 0;
+    buffer->len = 0;
+    buffers[fd] = buffer;
+  }
+
+  size_t done = 0;
+  while (done < count) {
+    if (buffer->pos == buffer->len) {
+      ssize_t bytes_read = read(fd, buffer->data, PARSER_BUFFER_SIZE);
+      if (bytes_read <= 0) break;
+      buffer->pos = 0;
+      buffer->len = (size_t)bytes_read;
+    }
+
+    size_t available = buffer->len - buffer->pos;
+    size_t n = count - done < available ? count - done : available;
+    memcpy(dst + done, buffer->data + buffer->pos, n);
+    buffer->pos += n;
+    done += n;
+  }
+
+  return done;
+}
+
+/// Reads a single byte.
+/// @return 1 if a byte was read, 0 at EOF.
+static int read_char(int fd, char *ch) {
+  if (fd >= 0 && fd < PARSER_MAX_FDS && buffers[fd] != NULL && buffers[fd]->pos < buffers[fd]->len) {
+    *ch = buffers[fd]->data[buffers[fd]->pos++];
+    return 1;
+  }
+
+  return (int)read_buffered(fd, ch, 1);
+}
+
+void parser_release(int fd) {
+  if (fd < 0 || fd >= PARSER_MAX_FDS) return;
+
+  free(buffers[fd]);
+  buffers[fd] = NULL;
+}
+
 static int read_uint(int fd, unsigned int *value, char *next) {
   char buf[16];
 
   int i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (read_char(fd, buf + i) == 0) {
       *next = '\0';
       break;
     }
@@ -40,19 +112,19 @@ static int read_uint(int fd, unsigned int *value, char *next) {
 
 static void cleanup(int fd) {
   char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
+  while (read_char(fd, &ch) == 1 && ch != '\n')
     ;
 }
 
 enum Command get_next(int fd) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (read_char(fd, buf) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'C':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "CREATE ", 7) != 0) {
+      if (read_buffered(fd, buf + 1, 6) != 6 || strncmp(buf, "CREATE ", 7) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -60,28 +132,55 @@ enum Command get_next(int fd) {
       return CMD_CREATE;
 
     case 'R':
-      if (read(fd, buf + 1, 7) != 7 || strncmp(buf, "RESERVE ", 8) != 0) {
+      if (read_buffered(fd, buf + 1, 7) != 7 || strncmp(buf, "RESERVE", 7) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (buf[7] == ' ')
+        return CMD_RESERVE;
+      if (buf[7] == '\n')
+        return CMD_INVALID;
+
+      if (read_buffered(fd, buf + 8, 5) != 5) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      if (strncmp(buf, "RESERVE_BEST ", 13) == 0)
+        return CMD_RESERVE_BEST;
+
+      if (strncmp(buf, "RESERVE_BATCH", 13) != 0 || read_buffered(fd, buf + 13, 1) != 1 || buf[13] != ' ') {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      return CMD_RESERVE;
+      return CMD_RESERVE_BATCH;
 
     case 'S':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "SHOW ", 5) != 0) {
+      if (read_buffered(fd, buf + 1, 4) != 4) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      return CMD_SHOW;
+      if (strncmp(buf, "SHOW ", 5) == 0)
+        return CMD_SHOW;
+
+      if (strncmp(buf, "SNAPS", 5) != 0 || read_buffered(fd, buf + 5, 4) != 4 ||
+          strncmp(buf, "SNAPSHOT ", 9) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_SNAPSHOT;
 
     case 'L':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "LIST", 4) != 0) {
+      if (read_buffered(fd, buf + 1, 3) != 3 || strncmp(buf, "LIST", 4) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+      if (read_buffered(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -89,12 +188,12 @@ enum Command get_next(int fd) {
       return CMD_LIST_EVENTS;
 
     case 'B':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "BARRIER", 7) != 0) {
+      if (read_buffered(fd, buf + 1, 6) != 6 || strncmp(buf, "BARRIER", 7) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 7, 1) != 0 && buf[7] != '\n') {
+      if (read_buffered(fd, buf + 7, 1) != 0 && buf[7] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -102,7 +201,7 @@ enum Command get_next(int fd) {
       return CMD_BARRIER;
 
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+      if (read_buffered(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -110,12 +209,12 @@ enum Command get_next(int fd) {
       return CMD_WAIT;
 
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+      if (read_buffered(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
         cleanup(fd);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
+      if (read_buffered(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
         cleanup(fd);
         return CMD_INVALID;
       }
@@ -168,14 +267,20 @@ size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs, siz
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
+  return parse_seats(fd, max, xs, ys);
+}
+
+size_t parse_seats(int fd, size_t max, size_t *xs, size_t *ys) {
+  char ch;
+
+  if (read_char(fd, &ch) != 1 || ch != '[') {
     cleanup(fd);
     return 0;
   }
 
   size_t num_coords = 0;
   while (num_coords < max) {
-    if (read(fd, &ch, 1) != 1 || ch != '(') {
+    if (read_char(fd, &ch) != 1 || ch != '(') {
       cleanup(fd);
       return 0;
     }
@@ -196,7 +301,7 @@ size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs, siz
 
     num_coords++;
 
-    if (read(fd, &ch, 1) != 1 || (ch != ' ' && ch != ']')) {
+    if (read_char(fd, &ch) != 1 || (ch != ' ' && ch != ']')) {
       cleanup(fd);
       return 0;
     }
@@ -211,7 +316,7 @@ size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs, siz
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+  if (read_char(fd, &ch) != 1 || (ch != '\n' && ch != '\0')) {
     cleanup(fd);
     return 0;
   }
@@ -219,6 +324,29 @@ size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs, siz
   return num_coords;
 }
 
+int parse_reserve_best(int fd, unsigned int *event_id, size_t *count) {
+  char ch;
+
+  if (read_uint(fd, event_id, &ch) != 0 || ch != ' ') {
+    cleanup(fd);
+    return 1;
+  }
+
+  unsigned int u_count;
+  if (read_uint(fd, &u_count, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 1;
+  }
+  *count = (size_t)u_count;
+
+  return 0;
+}
+
+int parse_reserve_batch(int fd, unsigned int *event_id, size_t *count) {
+  // Same layout as RESERVE_BEST, the count is of requests instead of seats
+  return parse_reserve_best(fd, event_id, count);
+}
+
 int parse_show(int fd, unsigned int *event_id) {
   char ch;
 
@@ -230,6 +358,22 @@ int parse_show(int fd, unsigned int *event_id) {
   return 0;
 }
 
+int parse_snapshot(int fd, char *path, size_t max) {
+  size_t len = 0;
+  char ch;
+
+  while (read_char(fd, &ch) == 1 && ch != '\n') {
+    if (len + 1 >= max) {
+      cleanup(fd);
+      return 1;
+    }
+    path[len++] = ch;
+  }
+  path[len] = '\0';
+
+  return len == 0;
+}
+
 int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
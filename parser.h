@@ -6,7 +6,10 @@
 enum Command {
   CMD_CREATE,
   CMD_RESERVE,
+  CMD_RESERVE_BEST,
+  CMD_RESERVE_BATCH,
   CMD_SHOW,
+  CMD_SNAPSHOT,
   CMD_LIST_EVENTS,
   CMD_BARRIER,
   CMD_WAIT,
@@ -16,6 +19,11 @@ enum Command {
   EOC  // End of commands
 };
 
+/// Releases the input buffer of a file descriptor.
+/// @note Must be called before closing a file descriptor that was read by the parser.
+/// @param fd File descriptor that will be closed.
+void parser_release(int fd);
+
 /// Reads a line and returns the corresponding command.
 /// @param fd File descriptor to read from.
 /// @return The command read.
@@ -38,12 +46,41 @@ int parse_create(int fd, unsigned int *event_id, size_t *num_rows, size_t *num_c
 /// @return Number of coordinates read. 0 on failure.
 size_t parse_reserve(int fd, size_t max, unsigned int *event_id, size_t *xs, size_t *ys);
 
+/// Parses a RESERVE_BEST command.
+/// @param fd File descriptor to read from.
+/// @param event_id Pointer to the variable to store the event ID in.
+/// @param count Pointer to the variable to store the number of seats in.
+/// @return 0 if the command was parsed successfully, 1 otherwise.
+int parse_reserve_best(int fd, unsigned int *event_id, size_t *count);
+
+/// Parses the first line of a RESERVE_BATCH command, the requests follow it one per line.
+/// @param fd File descriptor to read from.
+/// @param event_id Pointer to the variable to store the event ID in.
+/// @param count Pointer to the variable to store the number of requests in.
+/// @return 0 if the command was parsed successfully, 1 otherwise.
+int parse_reserve_batch(int fd, unsigned int *event_id, size_t *count);
+
+/// Parses a line with the seats of a request, as in a RESERVE command.
+/// @param fd File descriptor to read from.
+/// @param max Maximum number of coordinates to read.
+/// @param xs Pointer to the array to store the X coordinates in.
+/// @param ys Pointer to the array to store the Y coordinates in.
+/// @return Number of coordinates read. 0 on failure.
+size_t parse_seats(int fd, size_t max, size_t *xs, size_t *ys);
+
 /// Parses a SHOW command.
 /// @param fd File descriptor to read from.
 /// @param event_id Pointer to the variable to store the event ID in.
 /// @return 0 if the command was parsed successfully, 1 otherwise.
 int parse_show(int fd, unsigned int *event_id);
 
+/// Parses a SNAPSHOT command.
+/// @param fd File descriptor to read from.
+/// @param path Buffer to store the path in, NUL terminated.
+/// @param max Size of the buffer.
+/// @return 0 if the command was parsed successfully, 1 otherwise.
+int parse_snapshot(int fd, char *path, size_t max);
+
 /// Parses a WAIT command.
 /// @param fd File descriptor to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
@@ -0,0 +1,369 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "commandqueue.h"
+#include "constants.h"
+#include "operations.h"
+#include "parser.h"
+#include "scheduler.h"
+
+enum FileStatus { FILE_PENDING, FILE_OPENING, FILE_OPEN, FILE_CLOSING, FILE_DONE };
+
+// A job file of the run, with the workers currently on it.
+// Commands go through a parse-ahead queue as in ems_file, but the reader is whichever worker finds the queue
+// empty, as no thread is dedicated to a file.
+struct FileSlot {
+  JobFile file;
+  struct EmsState state;
+  enum FileStatus status;
+  struct CommandQueue queue;   // Commands parsed and not run yet, ending with the command that ends the segment
+  _Atomic int reading;         // 1 while a worker reads the file into the queue
+  _Atomic int segmentEnd;      // CMD_EMPTY while the segment runs, then the command that ended it
+  struct timespec barrierStart;
+  int lanes;        // Workers on the file
+  char *laneBusy;   // Thread ids of the file in use by those workers
+};
+
+struct Scheduler {
+  char *dirPath;
+  struct FileSlot *files;
+  size_t count;
+  size_t nextFile;   // First file not opened yet
+  size_t openFiles;  // Files opened and not closed yet
+  size_t maxOpen;
+  int maxThreads;
+  int failed;
+  long fileNs;           // Time each file was open, added up
+  pthread_mutex_t lock;  // Lock for everything above but the files being read
+  pthread_cond_t changed;
+};
+
+/// Picks the file an idle worker should join, opening the next one if that spreads the work.
+/// @note Called with the scheduler lock held, may release it while opening a file.
+/// @param sched Scheduler of the run.
+/// @return The file to join, NULL once every file is done.
+static struct FileSlot *pick_file(struct Scheduler *sched) {
+  while (1) {
+    struct FileSlot *best = NULL;
+    int busy = 0;
+    for (size_t i = 0; i < sched->nextFile; i++) {
+      struct FileSlot *slot = &sched->files[i];
+      if (slot->status != FILE_OPEN) {
+        busy |= slot->status != FILE_DONE;
+        continue;
+      }
+      busy = 1;
+      if (atomic_load(&slot->segmentEnd) != CMD_EMPTY || slot->lanes >= sched->maxThreads) continue;
+      if (best == NULL || slot->lanes < best->lanes) best = slot;
+    }
+
+    // A file nobody works on is a better use of the worker than a second lane
+    if ((best == NULL || best->lanes > 0) && sched->nextFile < sched->count && sched->openFiles < sched->maxOpen) {
+      struct FileSlot *slot = &sched->files[sched->nextFile++];
+      slot->status = FILE_OPENING;
+      sched->openFiles++;
+      pthread_mutex_unlock(&sched->lock);
+
+      int error = ems_state_init(&slot->state) != 0;
+      if (!error) {
+        error = jobfile_open(&slot->file, sched->dirPath, slot->file.name, sched->maxThreads, &slot->state) != 0;
+        if (error) ems_state_destroy(&slot->state);
+      }
+      if (!error && queue_init(&slot->queue, COMMAND_QUEUE_SIZE) != 0) {
+        jobfile_close(&slot->file);
+        ems_state_destroy(&slot->state);
+        error = 1;
+      }
+
+      pthread_mutex_lock(&sched->lock);
+      if (error) {
+        fprintf(stderr, "Failed to open %s\n", slot->file.name);
+        slot->status = FILE_DONE;
+        sched->openFiles--;
+        sched->failed = 1;
+      } else {
+        slot->status = FILE_OPEN;
+      }
+      pthread_cond_broadcast(&sched->changed);
+      continue;
+    }
+
+    if (best != NULL) return best;
+    if (!busy && sched->nextFile == sched->count) return NULL;
+    pthread_cond_wait(&sched->changed, &sched->lock);
+  }
+}
+
+/// Reads the next command of a file into its queue.
+/// @note Called by the worker that holds the reading flag of the file.
+/// @param slot File to read.
+/// @param record Where to leave a command for the caller to run.
+/// @return 0 if the command was handled, 1 if the queue failed, 2 if the caller must run record itself.
+static int read_command(struct FileSlot *slot, struct CommandRecord *record) {
+  enum Command cmd = parse_command(&slot->file, record);
+
+  if (cmd == CMD_BARRIER || cmd == EOC) {
+    clock_gettime(CLOCK_MONOTONIC, &slot->barrierStart);
+    atomic_store(&slot->segmentEnd, cmd);
+
+    // The end of the segment goes after every command of it, run some of them to make room if needed
+    struct CommandRecord other;
+    int result;
+    while ((result = queue_try_push(&slot->queue, record)) == 2) {
+      result = queue_try_pop(&slot->queue, &other);
+      if (result == 1) return 1;
+      if (result == 0) execute_command(&slot->file, &other);
+    }
+    return result;
+  }
+
+  // A WAIT for a specific thread must be applied before any later command is read
+  if (cmd == CMD_WAIT && record->thread_id != 0) {
+    execute_command(&slot->file, record);
+    return 0;
+  }
+
+  // With the queue full the other workers have enough to do, so the reader runs the command instead of waiting
+  return queue_try_push(&slot->queue, record);
+}
+
+/// Runs commands of a file until the end of its current segment.
+/// @param slot File to work on.
+/// @param lane Thread id of the worker in the file.
+/// @return 0 at the end of the segment, 1 if the queue of the file failed.
+static int run_segment(struct FileSlot *slot, int lane) {
+  struct CommandRecord record;
+  struct ThreadStats *stats = slot->file.stats != NULL ? &slot->file.stats[lane] : NULL;
+
+  while (1) {
+    wait_if_requested(&slot->file, lane);
+
+    int result = queue_try_pop(&slot->queue, &record);
+    if (result == 2 && atomic_load(&slot->segmentEnd) == CMD_EMPTY && !atomic_exchange(&slot->reading, 1)) {
+      // Nothing to run and nobody reading, so this worker reads
+      struct timespec start;
+      if (stats != NULL) clock_gettime(CLOCK_MONOTONIC, &start);
+      result = read_command(slot, &record);
+      atomic_store(&slot->reading, 0);
+      if (stats != NULL) {
+        stats->locks[STAT_LOCK_PARSE].acquisitions++;
+        stats->locks[STAT_LOCK_PARSE].hold_ns += (unsigned long)elapsed_ns(&start);
+      }
+      if (result == 1) return 1;
+      if (result == 2) execute_command(&slot->file, &record);
+      continue;
+    }
+
+    // Another worker is reading, or the end of the segment is on its way
+    if (result == 2) result = queue_pop(&slot->queue, &record);
+    if (result != 0) return 1;
+
+    if (record.cmd == CMD_BARRIER || record.cmd == EOC) {
+      // Put back for the next worker waiting on the queue, the last one out of the segment takes it
+      return queue_try_push(&slot->queue, &record) == 1;
+    }
+    execute_command(&slot->file, &record);
+  }
+}
+
+/// Main function of a worker, joins files until all of them are done.
+/// @param arg Scheduler of the run.
+/// @return NULL
+static void *worker_func(void *arg) {
+  struct Scheduler *sched = arg;
+
+  pthread_mutex_lock(&sched->lock);
+  struct FileSlot *slot;
+  while ((slot = pick_file(sched)) != NULL) {
+    int lane = 0;
+    while (slot->laneBusy[lane]) lane++;
+    slot->laneBusy[lane] = 1;
+    slot->lanes++;
+    pthread_mutex_unlock(&sched->lock);
+
+    ems_bind_state(&slot->state);
+    ems_bind_stats(slot->file.stats != NULL ? &slot->file.stats[lane] : NULL);
+    int failed = run_segment(slot, lane) != 0;
+    if (failed) {
+      // Every worker on the file stops, and the last one closes it
+      fprintf(stderr, "Failed to read the next command of %s\n", slot->file.name);
+      atomic_store(&slot->segmentEnd, EOC);
+      queue_abort(&slot->queue);
+    }
+    ems_flush_cache_stats();
+    ems_bind_stats(NULL);
+    ems_bind_state(NULL);
+
+    pthread_mutex_lock(&sched->lock);
+    slot->laneBusy[lane] = 0;
+    if (failed) sched->failed = 1;
+    if (--slot->lanes > 0) continue;
+
+    // Last worker out of the segment, every command before its end has been executed and only the end is left
+    struct CommandRecord end;
+    while (queue_try_pop(&slot->queue, &end) == 0) {
+    }
+    if (atomic_load(&slot->segmentEnd) == CMD_BARRIER) {
+      slot->file.barriers++;
+      slot->file.barrierNs += elapsed_ns(&slot->barrierStart);
+      atomic_store(&slot->segmentEnd, CMD_EMPTY);
+    } else if (atomic_load(&slot->segmentEnd) == EOC) {
+      slot->status = FILE_CLOSING;
+      sched->fileNs += elapsed_ns(&slot->file.opened);
+      pthread_mutex_unlock(&sched->lock);
+
+      queue_destroy(&slot->queue);
+      jobfile_close(&slot->file);
+      ems_state_destroy(&slot->state);
+
+      pthread_mutex_lock(&sched->lock);
+      slot->status = FILE_DONE;
+      sched->openFiles--;
+    }
+    pthread_cond_broadcast(&sched->changed);
+  }
+  pthread_mutex_unlock(&sched->lock);
+
+  return NULL;
+}
+
+int ems_run_files(char *dirPath, char **filenames, size_t count, int workers, int maxThreads, long *fileNs) {
+  struct Scheduler sched = {.dirPath = dirPath, .count = count, .maxThreads = maxThreads};
+  // Every open file holds a read buffer and a state, keep only as many as the workers can use
+  sched.maxOpen = (size_t)workers;
+
+  sched.files = calloc(count, sizeof(struct FileSlot));
+  if (sched.files == NULL && count > 0) return -1;
+
+  for (size_t i = 0; i < count; i++) {
+    struct FileSlot *slot = &sched.files[i];
+    slot->file.name = filenames[i];
+    slot->status = FILE_PENDING;
+    atomic_init(&slot->reading, 0);
+    atomic_init(&slot->segmentEnd, CMD_EMPTY);
+    slot->laneBusy = calloc((size_t)maxThreads, sizeof(char));
+    if (slot->laneBusy == NULL) return -1;
+  }
+
+  if (pthread_mutex_init(&sched.lock, NULL) != 0 || pthread_cond_init(&sched.changed, NULL) != 0) return -1;
+
+  pthread_t tid[workers];
+  int started = 0;
+  for (; started < workers; started++) {
+    if (pthread_create(&tid[started], NULL, worker_func, &sched) != 0) {
+      fprintf(stderr, "Error creating thread\n");
+      sched.failed = 1;
+      break;
+    }
+  }
+
+  for (int i = 0; i < started; i++) {
+    if (pthread_join(tid[i], NULL) != 0) {
+      fprintf(stderr, "Error joining thread\n");
+      sched.failed = 1;
+    }
+  }
+
+  pthread_cond_destroy(&sched.changed);
+  pthread_mutex_destroy(&sched.lock);
+  for (size_t i = 0; i < count; i++) free(sched.files[i].laneBusy);
+  free(sched.files);
+
+  *fileNs = sched.fileNs;
+  return sched.failed || started == 0 ? -1 : 0;
+}
+
+struct WeightedFile {
+  char *name;
+  unsigned long weight;
+};
+
+/// Counts the lines of a job file.
+/// @param path Path of the file.
+/// @param lines Where to store the number of lines.
+/// @return 0 if the file was read, -1 otherwise.
+static int count_lines(const char *path, unsigned long *lines) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+
+  char buffer[65536];
+  ssize_t bytes;
+  *lines = 0;
+  while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t i = 0; i < bytes; i++) *lines += buffer[i] == '\n';
+  }
+
+  close(fd);
+  return bytes < 0 ? -1 : 0;
+}
+
+/// Orders files by weight, heaviest first, then by name so the order does not depend on readdir.
+static int compare_weight(const void *a, const void *b) {
+  const struct WeightedFile *fa = a, *fb = b;
+  if (fa->weight != fb->weight) return fa->weight < fb->weight ? 1 : -1;
+  return strcmp(fa->name, fb->name);
+}
+
+int schedule_files(char *dirPath, char **filenames, size_t count, int slots, enum ScheduleWeight weight,
+                   unsigned long *predicted, unsigned long *total) {
+  struct WeightedFile *files = malloc((count > 0 ? count : 1) * sizeof(struct WeightedFile));
+  unsigned long *loads = calloc((size_t)(slots > 0 ? slots : 1), sizeof(unsigned long));
+  if (files == NULL || loads == NULL) {
+    free(files);
+    free(loads);
+    return -1;
+  }
+
+  *total = 0;
+  for (size_t i = 0; i < count; i++) {
+    char path[strlen(dirPath) + strlen(filenames[i]) + 2];
+    snprintf(path, sizeof(path), "%s/%s", dirPath, filenames[i]);
+
+    files[i].name = filenames[i];
+    files[i].weight = 0;
+    // A file that can not be measured would make the prediction wrong
+    int error;
+    if (weight == SCHEDULE_COMMANDS) {
+      error = count_lines(path, &files[i].weight) != 0;
+    } else {
+      struct stat st;
+      error = stat(path, &st) != 0;
+      if (!error) files[i].weight = (unsigned long)st.st_size;
+    }
+    if (error) {
+      fprintf(stderr, "Failed to measure %s: %s\n", filenames[i], strerror(errno));
+      free(files);
+      free(loads);
+      return -1;
+    }
+    *total += files[i].weight;
+  }
+
+  qsort(files, count, sizeof(struct WeightedFile), compare_weight);
+
+  // Each file goes to whichever slot frees up first, which is the least loaded one
+  *predicted = 0;
+  for (size_t i = 0; i < count; i++) {
+    filenames[i] = files[i].name;
+
+    size_t least = 0;
+    for (size_t s = 1; s < (size_t)slots; s++) {
+      if (loads[s] < loads[least]) least = s;
+    }
+    loads[least] += files[i].weight;
+    if (loads[least] > *predicted) *predicted = loads[least];
+  }
+
+  free(files);
+  free(loads);
+  return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+
+// What the size of a job file is measured in when scheduling
+enum ScheduleWeight {
+  SCHEDULE_BYTES,     // Size of the file
+  SCHEDULE_COMMANDS,  // Number of lines of the file, an estimate of its commands
+};
+
+/// Runs job files in this process on a pool of worker threads shared by all of them.
+/// @note Each file gets its own EMS state and command queue. Idle workers join the segment of the file
+/// with the fewest workers, or open the next file, so a file never waits for a process. The workers on a
+/// file share its queue, and whichever of them finds it empty reads the next commands into it.
+/// @param dirPath the path to the dir.
+/// @param filenames names of the files to run, relative to dirPath.
+/// @param count number of files.
+/// @param workers number of worker threads, shared by every file.
+/// @param maxThreads maximum number of workers on the same file at once.
+/// @param fileNs where to store the time each file was open, added up over the files.
+/// @return 0 if every file ran, -1 if any could not be run.
+int ems_run_files(char *dirPath, char **filenames, size_t count, int workers, int maxThreads, long *fileNs);
+
+/// Orders job files largest first, so that a large file found late does not run alone at the end.
+/// @param dirPath the path to the dir.
+/// @param filenames names of the files, relative to dirPath, reordered in place.
+/// @param count number of files.
+/// @param slots number of files that run at the same time.
+/// @param weight what the size of a file is measured in.
+/// @param predicted where to store the size given to the busiest slot when files go to the least loaded one.
+/// @param total where to store the size of all the files.
+/// @return 0 if the files were ordered, -1 if any could not be measured or memory ran out.
+int schedule_files(char *dirPath, char **filenames, size_t count, int slots, enum ScheduleWeight weight,
+                   unsigned long *predicted, unsigned long *total);
+
+#endif  // SCHEDULER_H
@@ -0,0 +1,182 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Writes zeros up to the next multiple of SNAPSHOT_ALIGN.
+/// @return 0 if the padding was written, 1 otherwise.
+static int write_padding(struct SnapshotWriter *writer) {
+  static const char zeros[SNAPSHOT_ALIGN] = {0};
+  size_t padding = (SNAPSHOT_ALIGN - writer->offset % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+  if (write_all(writer->fd, zeros, padding) != 0) return 1;
+  writer->offset += padding;
+  return 0;
+}
+
+int snapshot_begin(struct SnapshotWriter *writer, const char *path) {
+  size_t len = strlen(path);
+  writer->path = malloc(len + 1);
+  writer->tmpPath = malloc(len + 5);
+  if (writer->path == NULL || writer->tmpPath == NULL) {
+    free(writer->path);
+    free(writer->tmpPath);
+    return 1;
+  }
+  memcpy(writer->path, path, len + 1);
+  snprintf(writer->tmpPath, len + 5, "%s.tmp", path);
+
+  writer->fd = open(writer->tmpPath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (writer->fd < 0) {
+    fprintf(stderr, "open error: %s\n", strerror(errno));
+    free(writer->path);
+    free(writer->tmpPath);
+    return 1;
+  }
+
+  outbuf_init(&writer->table);
+  writer->num_events = 0;
+  writer->offset = 0;
+
+  // The header is written again with the table offset once the events are in
+  struct SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  if (write_all(writer->fd, (const char *)&header, sizeof(header)) != 0) return snapshot_end(writer, 0) | 1;
+  writer->offset = sizeof(header);
+  return 0;
+}
+
+/// Writes the seats and the bitmap of an event in the layout of event_seats_size.
+/// @note A sparse event is written as if it was dense, with zeros for the chunks it does not have. Once it
+/// turned dense its seats are no longer next to the bitmap, so the two are always written separately.
+/// @return 0 if the seats were written, 1 otherwise.
+static int write_seats(struct SnapshotWriter *writer, struct Event *event) {
+  static const _Atomic unsigned int zeros[EVENT_CHUNK_SEATS];
+  size_t num_seats = event->rows * event->cols;
+  size_t data_size = num_seats * sizeof(_Atomic unsigned int);
+
+  _Atomic unsigned int *data = event_seats_begin(event);
+  int failed = data != NULL && write_all(writer->fd, (const char *)data, data_size) != 0;
+  for (size_t first = 0; data == NULL && first < num_seats && !failed; first += EVENT_CHUNK_SEATS) {
+    size_t count = num_seats - first < EVENT_CHUNK_SEATS ? num_seats - first : EVENT_CHUNK_SEATS;
+    const _Atomic unsigned int *chunk = event_sparse_seat(event, first, 0);
+    failed = write_all(writer->fd, (const char *)(chunk != NULL ? chunk : zeros), count * sizeof(*chunk)) != 0;
+  }
+  event_seats_end(event);
+  if (failed) return 1;
+
+  // The bitmap starts on a multiple of 8
+  size_t padded = (data_size + 7) / 8 * 8;
+  if (write_all(writer->fd, (const char *)zeros, padded - data_size) != 0) return 1;
+  return write_all(writer->fd, (const char *)event->occupied, event_seats_size(event->rows, event->cols) - padded);
+}
+
+int snapshot_add(struct SnapshotWriter *writer, struct Event *event, unsigned int reservations) {
+  if (write_padding(writer) != 0) return 1;
+
+  struct SnapshotEntry entry = {event->id, reservations, event->rows, event->cols, writer->offset};
+  size_t size = event_seats_size(event->rows, event->cols);
+  if (size > 0 && write_seats(writer, event) != 0) return 1;
+  writer->offset += size;
+
+  if (outbuf_put(&writer->table, (const char *)&entry, sizeof(entry)) != 0) return 1;
+  writer->num_events++;
+  return 0;
+}
+
+int snapshot_end(struct SnapshotWriter *writer, int ok) {
+  if (ok) ok = write_padding(writer) == 0;
+
+  struct SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.entry_size = sizeof(struct SnapshotEntry);
+  header.num_events = writer->num_events;
+  header.table = writer->offset;
+
+  if (ok) ok = write_all(writer->fd, writer->table.data, writer->table.len) == 0;
+  if (ok) ok = pwrite(writer->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+  if (close(writer->fd) != 0) ok = 0;
+
+  // Readers of the old snapshot never see a partial new one
+  if (ok && rename(writer->tmpPath, writer->path) != 0) {
+    fprintf(stderr, "rename error: %s\n", strerror(errno));
+    ok = 0;
+  }
+  if (!ok) unlink(writer->tmpPath);
+
+  outbuf_free(&writer->table);
+  free(writer->path);
+  free(writer->tmpPath);
+  return !ok;
+}
+
+int snapshot_load(struct EventList *list, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "open error: %s\n", strerror(errno));
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct SnapshotHeader)) {
+    fprintf(stderr, "Invalid snapshot %s\n", path);
+    close(fd);
+    return 1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  // Private and writable, reservations made on the loaded events copy the pages they touch
+  void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "mmap error: %s\n", strerror(errno));
+    return 1;
+  }
+
+  const struct SnapshotHeader *header = mapping;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->version != SNAPSHOT_VERSION ||
+      header->entry_size != sizeof(struct SnapshotEntry) || header->table > size ||
+      header->table % _Alignof(struct SnapshotEntry) != 0 ||
+      header->num_events > (size - header->table) / sizeof(struct SnapshotEntry)) {
+    fprintf(stderr, "Invalid snapshot %s\n", path);
+    munmap(mapping, size);
+    return 1;
+  }
+
+  const struct SnapshotEntry *entries = (const struct SnapshotEntry *)((char *)mapping + header->table);
+  for (uint64_t i = 0; i < header->num_events; i++) {
+    const struct SnapshotEntry *entry = &entries[i];
+    int too_big = entry->rows != 0 && entry->cols > size / sizeof(unsigned int) / entry->rows;
+    size_t seats_size = too_big ? 0 : event_seats_size(entry->rows, entry->cols);
+    if (too_big || entry->seats % SNAPSHOT_ALIGN != 0 || entry->seats > header->table ||
+        seats_size > header->table - entry->seats) {
+      fprintf(stderr, "Invalid snapshot %s\n", path);
+      // Events already appended point into the mapping, it goes with the list
+      list->snapshot = mapping;
+      list->snapshot_size = size;
+      return 1;
+    }
+
+    struct Event *event =
+        create_event_at(list, entry->id, entry->rows, entry->cols, seats_size ? (char *)mapping + entry->seats : NULL);
+    if (event == NULL || append_to_list(list, event) != 0) {
+      fprintf(stderr, "Failed to load event %u from the snapshot\n", entry->id);
+      free_event(event);
+      list->snapshot = mapping;
+      list->snapshot_size = size;
+      return 1;
+    }
+    atomic_store(&event->reservations, entry->reservations);
+  }
+
+  list->snapshot = mapping;
+  list->snapshot_size = size;
+  return 0;
+}
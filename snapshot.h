@@ -0,0 +1,71 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "eventlist.h"
+#include "outbuffer.h"
+
+#define SNAPSHOT_MAGIC "EMSSNAP1"  // First bytes of a snapshot file
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGN 64  // Alignment of the seats of each event in the file
+
+// Snapshot file: this header, the seats of every event, then the event table.
+// Everything is located by offsets from the start of the file, so the file can be mapped anywhere.
+// Numbers are in the byte order of the machine that wrote the file.
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;  // sizeof(struct SnapshotEntry), to reject files of another layout
+  uint64_t num_events;
+  uint64_t table;       // Offset of the event table
+};
+
+struct SnapshotEntry {
+  uint32_t id;
+  uint32_t reservations;
+  uint64_t rows;
+  uint64_t cols;
+  uint64_t seats;  // Offset of the seats, event_seats_size(rows, cols) bytes laid out as in memory
+};
+
+// Snapshot being written
+struct SnapshotWriter {
+  int fd;
+  char *path;     // Final path, the file is written next to it and renamed when complete
+  char *tmpPath;
+  uint64_t offset;             // Bytes written so far
+  struct OutBuffer table;      // Entries of the events written so far
+  uint64_t num_events;
+};
+
+/// Starts writing a snapshot.
+/// @param writer Writer to initialize.
+/// @param path Path of the snapshot, replaced only once the new one is complete.
+/// @return 0 if the snapshot was started, 1 otherwise.
+int snapshot_begin(struct SnapshotWriter *writer, const char *path);
+
+/// Adds an event to a snapshot.
+/// @note The caller keeps the seats from changing while they are written.
+/// @param writer Snapshot being written.
+/// @param event Event to add.
+/// @param reservations Reservation counter of the event, read after its seats.
+/// @return 0 if the event was written, 1 otherwise.
+int snapshot_add(struct SnapshotWriter *writer, struct Event *event, unsigned int reservations);
+
+/// Finishes a snapshot, writing its table and moving it into place, or discards it.
+/// @param writer Snapshot being written.
+/// @param ok 1 to finish the snapshot, 0 to discard it.
+/// @return 0 if the snapshot is in place, 1 otherwise.
+int snapshot_end(struct SnapshotWriter *writer, int ok);
+
+/// Loads the events of a snapshot into an empty list.
+/// @note The file is mapped copy-on-write and the events use its pages directly, so it takes time in the
+/// number of events only. Changes to the events never reach the file.
+/// @param list Empty event list to load into.
+/// @param path Path of the snapshot.
+/// @return 0 if the snapshot was loaded, 1 otherwise.
+int snapshot_load(struct EventList *list, const char *path);
+
+#endif  // SNAPSHOT_H
@@ -0,0 +1,66 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "outbuffer.h"
+
+static const char *command_names[STAT_COMMANDS] = {"create_", "reserve_", "reserve_best_", "reserve_batch_", "show_", "snapshot_", "list_", "wait_", "help_"};
+static const char *lock_names[STAT_LOCKS] = {"parse", "seats"};
+
+void stats_init(struct ThreadStats *stats) { memset(stats, 0, sizeof(*stats)); }
+
+int stats_write(const struct ThreadStats *slots, size_t count, int fd, long elapsed_ns) {
+  // Merged on the heap, each histogram is several kilobytes
+  struct ThreadStats *total = malloc(sizeof(struct ThreadStats));
+  struct LatencyHistogram *all = malloc(sizeof(struct LatencyHistogram));
+  if (total == NULL || all == NULL) {
+    free(total);
+    free(all);
+    return 1;
+  }
+  stats_init(total);
+  latency_init(all);
+
+  for (size_t i = 0; i < count; i++) {
+    for (int c = 0; c < STAT_COMMANDS; c++) latency_merge(&total->commands[c], &slots[i].commands[c]);
+    latency_merge(&total->parse, &slots[i].parse);
+    for (int l = 0; l < STAT_LOCKS; l++) {
+      total->locks[l].acquisitions += slots[i].locks[l].acquisitions;
+      total->locks[l].wait_ns += slots[i].locks[l].wait_ns;
+      total->locks[l].hold_ns += slots[i].locks[l].hold_ns;
+    }
+    total->sleeps += slots[i].sleeps;
+    total->sleep_ns += slots[i].sleep_ns;
+  }
+  for (int c = 0; c < STAT_COMMANDS; c++) latency_merge(all, &total->commands[c]);
+
+  char text[256];
+  int len = snprintf(text, sizeof(text), "elapsed_ms %.3f\n", (double)elapsed_ns / 1e6);
+  int result = write_all(fd, text, (size_t)len);
+
+  // Every command first, then each type on its own
+  result |= latency_write(all, fd, "");
+  for (int c = 0; c < STAT_COMMANDS && result == 0; c++) {
+    if (total->commands[c].total > 0) result |= latency_write(&total->commands[c], fd, command_names[c]);
+  }
+  if (result == 0) result |= latency_write(&total->parse, fd, "parse_");
+
+  for (int l = 0; l < STAT_LOCKS && result == 0; l++) {
+    len = snprintf(text, sizeof(text), "lock_%s_acquisitions %lu\nlock_%s_wait_us %.3f\nlock_%s_hold_us %.3f\n",
+                   lock_names[l], total->locks[l].acquisitions, lock_names[l],
+                   (double)total->locks[l].wait_ns / 1e3, lock_names[l], (double)total->locks[l].hold_ns / 1e3);
+    result |= write_all(fd, text, (size_t)len);
+  }
+
+  if (result == 0) {
+    len = snprintf(text, sizeof(text), "delay_sleeps %lu\ndelay_sleep_us %.3f\n", total->sleeps,
+                   (double)total->sleep_ns / 1e3);
+    result |= write_all(fd, text, (size_t)len);
+  }
+
+  free(total);
+  free(all);
+  return result;
+}
@@ -0,0 +1,45 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+#include "latency.h"
+
+// Commands timed separately
+enum StatCommand { STAT_CREATE, STAT_RESERVE, STAT_RESERVE_BEST, STAT_RESERVE_BATCH, STAT_SHOW, STAT_SNAPSHOT, STAT_LIST, STAT_WAIT, STAT_HELP, STAT_COMMANDS };
+
+// Locks whose wait and hold times are counted
+enum StatLock {
+  STAT_LOCK_PARSE,  // Reading the job file into its queue, by the worker reading it in --workers mode
+  STAT_LOCK_SEATS,  // Seat locks of an event, once per set taken by a RESERVE or SHOW
+  STAT_LOCKS
+};
+
+struct LockCounter {
+  unsigned long acquisitions;
+  unsigned long wait_ns;  // Time spent waiting to get the lock
+  unsigned long hold_ns;  // Time the lock was held
+};
+
+// Statistics of one thread on one job file, only ever written by that thread
+struct ThreadStats {
+  struct LatencyHistogram commands[STAT_COMMANDS];  // Time to execute each type of command
+  struct LatencyHistogram parse;                    // Time to parse a command, including the wait for the file
+  struct LockCounter locks[STAT_LOCKS];
+  unsigned long sleeps;    // Simulated state accesses
+  unsigned long sleep_ns;  // Time spent in them
+};
+
+/// Initializes the statistics of a thread.
+/// @param stats Statistics to initialize.
+void stats_init(struct ThreadStats *stats);
+
+/// Merges the statistics of every thread of a job file and writes them, one "name value" pair per line.
+/// @param slots Statistics of each thread.
+/// @param count Number of threads.
+/// @param fd File descriptor of the file to write to.
+/// @param elapsed_ns Time the job file took.
+/// @return 0 if everything was written, 1 otherwise.
+int stats_write(const struct ThreadStats *slots, size_t count, int fd, long elapsed_ns);
+
+#endif  // STATS_H
@@ -0,0 +1,42 @@
+#!/bin/sh
+# RESERVE_BATCH on a sparse event whose batch crosses the threshold at which it turns dense, in both
+# reservation modes. A hang here is the batch deadlocking on the layout lock of the event.
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=${WORK:-/tmp/ems-test-sparse-batch}
+
+# 1024 x 1024 seats start sparse with 16384 chunks of 64 seats, so the 2048th chunk turns the event dense.
+# Every RESERVE takes the first seat of a chunk of its own, the batch takes the 2048th chunk.
+rm -rf "$WORK"
+mkdir -p "$WORK"
+{
+  echo "CREATE 1 1024 1024"
+  i=0
+  while [ $i -lt 2047 ]; do
+    echo "RESERVE 1 [($((i / 16 + 1)),$((i % 16 * 64 + 1)))]"
+    i=$((i + 1))
+  done
+  echo "RESERVE_BATCH 1 2"
+  echo "[(128,961)]"
+  echo "[(1,1)]"
+  echo "SHOW 1"
+} > "$WORK/a.jobs"
+
+for mode in locks cas; do
+  rm -f "$WORK/a.out"
+  if ! timeout 60 "$ROOT/ems" --reserve=$mode "$WORK" 1 1 0 >/dev/null 2>"$WORK/err"; then
+    echo "sparse_batch: --reserve=$mode failed or hung" >&2
+    exit 1
+  fi
+
+  # Seat (128,961) got the 2048th reservation, and only the second request of the batch failed
+  taken=$(tr ' ' '\n' < "$WORK/a.out" | grep -vc '^0$')
+  seat=$(sed -n 128p "$WORK/a.out" | cut -d' ' -f961)
+  if [ "$taken" -ne 2048 ] || [ "$seat" -ne 2048 ] || [ "$(grep -c 'already reserved' "$WORK/err")" -ne 1 ]; then
+    echo "sparse_batch: --reserve=$mode left $taken seats taken, seat (128,961) is $seat" >&2
+    exit 1
+  fi
+done
+
+echo "sparse_batch: ok"
@@ -0,0 +1,26 @@
+#!/bin/sh
+# A run recovered from a reservation log writes a log that can be recovered from on its own.
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=${WORK:-/tmp/ems-test-wal-chain}
+
+rm -rf "$WORK"
+mkdir -p "$WORK/1" "$WORK/2" "$WORK/3"
+printf 'CREATE 1 3 3\nRESERVE 1 [(1,1) (1,2)]\nRESERVE 1 [(2,2)]\nCREATE 2 2 2\n' > "$WORK/1/a.jobs"
+printf 'RESERVE 1 [(3,3)]\nRESERVE 2 [(1,1)]\n' > "$WORK/2/a.jobs"
+printf 'SHOW 1\nSHOW 2\n' > "$WORK/3/a.jobs"
+
+"$ROOT/ems" --wal "$WORK/1" 1 1 0 >/dev/null
+"$ROOT/ems" --wal --recover="$WORK/1/a.wal" "$WORK/2" 1 1 0 >/dev/null
+if ! "$ROOT/ems" --recover="$WORK/2/a.wal" "$WORK/3" 1 1 0 >/dev/null; then
+  echo "wal_chain: the log of a recovered run could not be recovered from" >&2
+  exit 1
+fi
+
+if [ "$(cat "$WORK/3/a.out")" != "$(printf '1 1 0\n0 2 0\n0 0 3\n1 0\n0 0')" ]; then
+  echo "wal_chain: recovered state differs from the one logged" >&2
+  exit 1
+fi
+
+echo "wal_chain: ok"
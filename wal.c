@@ -0,0 +1,328 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "outbuffer.h"
+
+static unsigned int flush_interval_us = WAL_FLUSH_INTERVAL_US;
+
+/// Adds bytes to an FNV-1a hash.
+/// @return The updated hash.
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/// Computes the checksum of a record and its seats.
+static uint64_t record_checksum(const struct WalRecord *record, const uint64_t *seats, size_t num_seats) {
+  struct WalRecord copy = *record;
+  copy.checksum = 0;
+  uint64_t hash = fnv1a(0xcbf29ce484222325ULL, &copy, sizeof(copy));
+  return fnv1a(hash, seats, num_seats * sizeof(uint64_t));
+}
+
+static long since_ns(const struct timespec *start, const struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+/// Gets the group of a batch in wal->by_batch.
+static unsigned int batch_class(unsigned long records) {
+  unsigned int class = 0;
+  while (records > 1 && class < WAL_BATCH_CLASSES - 1) {
+    records >>= 1;
+    class++;
+  }
+  return class;
+}
+
+/// Main function of the flusher, writes the buffer in batches until the log is closed.
+static void *wal_flusher(void *arg) {
+  struct WriteAheadLog *wal = arg;
+
+  pthread_mutex_lock(&wal->lock);
+  while (1) {
+    while (wal->used == 0 && !wal->closing) pthread_cond_wait(&wal->pending, &wal->lock);
+    if (wal->used == 0) break;
+
+    // Let more records join the batch, unless it is big enough already
+    struct timespec deadline = wal->first_at;
+    deadline.tv_nsec += (long)flush_interval_us * 1000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while (wal->used < WAL_FLUSH_BYTES && !wal->closing &&
+           pthread_cond_timedwait(&wal->pending, &wal->lock, &deadline) != ETIMEDOUT) {
+    }
+
+    // Appenders fill the other buffer while this batch is written
+    char *batch = wal->buffer;
+    size_t size = wal->used;
+    size_t capacity = wal->capacity;
+    unsigned long target = wal->appended;
+    unsigned long records = target - wal->synced;
+    struct timespec oldest = wal->first_at;
+    wal->buffer = wal->spare;
+    wal->capacity = wal->spare_capacity;
+    wal->used = 0;
+    pthread_mutex_unlock(&wal->lock);
+
+    int error = write_all(wal->fd, batch, size) != 0 || fdatasync(wal->fd) != 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&wal->lock);
+    wal->spare = batch;
+    wal->spare_capacity = capacity;
+    if (error) {
+      fprintf(stderr, "Failed to write the reservation log: %s\n", strerror(errno));
+      wal->failed = 1;
+    } else {
+      wal->synced = target;
+      wal->batches++;
+      wal->bytes += size;
+      latency_record(&wal->by_batch[batch_class(records)], (unsigned long)since_ns(&oldest, &now));
+    }
+    pthread_cond_broadcast(&wal->durable);
+    if (error) break;
+  }
+  pthread_mutex_unlock(&wal->lock);
+
+  return NULL;
+}
+
+void wal_set_interval(unsigned int interval_us) { flush_interval_us = interval_us; }
+
+int wal_open(struct WriteAheadLog *wal, const char *path) {
+  wal->fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+  if (wal->fd < 0) {
+    fprintf(stderr, "open error: %s\n", strerror(errno));
+    return 1;
+  }
+  // Made durable along with the first batch
+  if (write_all(wal->fd, WAL_MAGIC, strlen(WAL_MAGIC)) != 0) {
+    close(wal->fd);
+    return 1;
+  }
+
+  wal->buffer = NULL;
+  wal->used = 0;
+  wal->capacity = 0;
+  wal->spare = NULL;
+  wal->spare_capacity = 0;
+  wal->appended = 0;
+  wal->synced = 0;
+  wal->closing = 0;
+  wal->failed = 0;
+  wal->batches = 0;
+  wal->bytes = 0;
+  latency_init(&wal->commit);
+  for (int i = 0; i < WAL_BATCH_CLASSES; i++) latency_init(&wal->by_batch[i]);
+
+  // Deadlines of the flusher are taken from the monotonic clock
+  pthread_condattr_t attr;
+  int initialized = 0;  // Synchronization objects initialized so far, destroyed in reverse order on failure
+  if (pthread_condattr_init(&attr) == 0) {
+    if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0 && pthread_cond_init(&wal->pending, &attr) == 0)
+      initialized++;
+    pthread_condattr_destroy(&attr);
+  }
+  if (initialized == 1 && pthread_cond_init(&wal->durable, NULL) == 0) initialized++;
+  if (initialized == 2 && pthread_mutex_init(&wal->lock, NULL) == 0) initialized++;
+
+  if (initialized == 3 && pthread_create(&wal->flusher, NULL, wal_flusher, wal) == 0) return 0;
+  if (initialized == 3) fprintf(stderr, "Error creating thread\n");
+
+  if (initialized > 2) pthread_mutex_destroy(&wal->lock);
+  if (initialized > 1) pthread_cond_destroy(&wal->durable);
+  if (initialized > 0) pthread_cond_destroy(&wal->pending);
+  close(wal->fd);
+  return 1;
+}
+
+int wal_append(struct WriteAheadLog *wal, struct WalRecord *records, const uint64_t *seats, size_t count) {
+  size_t size = 0;
+  const uint64_t *record_seats = seats;
+  for (size_t i = 0; i < count; i++) {
+    size_t num_seats = records[i].type == WAL_RESERVE ? (size_t)records[i].b : 0;
+    records[i].checksum = record_checksum(&records[i], record_seats, num_seats);
+    record_seats += num_seats;
+    size += sizeof(records[i]) + num_seats * sizeof(uint64_t);
+  }
+  if (count == 0) return 0;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_mutex_lock(&wal->lock);
+  if (wal->failed) {
+    pthread_mutex_unlock(&wal->lock);
+    return 1;
+  }
+
+  size_t needed = wal->used + size;
+  if (needed > wal->capacity) {
+    size_t capacity = wal->capacity ? wal->capacity : WAL_FLUSH_BYTES;
+    while (capacity < needed) capacity *= 2;
+    char *grown = realloc(wal->buffer, capacity);
+    if (grown == NULL) {
+      pthread_mutex_unlock(&wal->lock);
+      return 1;
+    }
+    wal->buffer = grown;
+    wal->capacity = capacity;
+  }
+
+  char *out = wal->buffer + wal->used;
+  record_seats = seats;
+  for (size_t i = 0; i < count; i++) {
+    size_t seats_size = records[i].type == WAL_RESERVE ? (size_t)records[i].b * sizeof(uint64_t) : 0;
+    memcpy(out, &records[i], sizeof(records[i]));
+    if (seats_size > 0) memcpy(out + sizeof(records[i]), record_seats, seats_size);
+    out += sizeof(records[i]) + seats_size;
+    record_seats += seats_size / sizeof(uint64_t);
+  }
+
+  // The flusher only needs waking for the first record of a batch and once the batch is big enough
+  if (wal->used == 0) {
+    wal->first_at = start;
+    pthread_cond_signal(&wal->pending);
+  } else if (wal->used < WAL_FLUSH_BYTES && needed >= WAL_FLUSH_BYTES) {
+    pthread_cond_signal(&wal->pending);
+  }
+  wal->used = needed;
+  wal->appended += count;
+  unsigned long ticket = wal->appended;
+
+  while (wal->synced < ticket && !wal->failed) pthread_cond_wait(&wal->durable, &wal->lock);
+
+  int result = wal->synced < ticket;
+  if (!result) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (size_t i = 0; i < count; i++) latency_record(&wal->commit, (unsigned long)since_ns(&start, &now));
+  }
+  pthread_mutex_unlock(&wal->lock);
+
+  return result;
+}
+
+int wal_close(struct WriteAheadLog *wal) {
+  pthread_mutex_lock(&wal->lock);
+  wal->closing = 1;
+  pthread_cond_signal(&wal->pending);
+  pthread_mutex_unlock(&wal->lock);
+
+  pthread_join(wal->flusher, NULL);
+  int result = wal->failed || wal->synced != wal->appended;
+  if (close(wal->fd) != 0) result = 1;
+
+  free(wal->buffer);
+  free(wal->spare);
+  pthread_mutex_destroy(&wal->lock);
+  pthread_cond_destroy(&wal->durable);
+  pthread_cond_destroy(&wal->pending);
+  return result;
+}
+
+int wal_write_stats(const struct WriteAheadLog *wal, int fd) {
+  char text[256];
+  int len = snprintf(text, sizeof(text), "wal_batches %lu\nwal_records %lu\nwal_bytes %lu\nwal_records_per_batch %.3f\n",
+                     wal->batches, wal->synced, wal->bytes,
+                     wal->batches ? (double)wal->synced / (double)wal->batches : 0.0);
+  int result = write_all(fd, text, (size_t)len);
+  if (result == 0) result |= latency_write(&wal->commit, fd, "wal_commit_");
+
+  // Commit latency of the oldest record of each batch, against the number of records in the batch
+  for (unsigned int i = 0; i < WAL_BATCH_CLASSES && result == 0; i++) {
+    if (wal->by_batch[i].total == 0) continue;
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "wal_batch_%lu_", 1UL << i);
+    result |= latency_write(&wal->by_batch[i], fd, prefix);
+  }
+
+  return result;
+}
+
+int wal_replay(const char *path, int (*apply)(const struct WalRecord *record, const uint64_t *seats, void *context),
+               void *context) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "open error: %s\n", strerror(errno));
+    return 1;
+  }
+
+  struct stat st;
+  size_t magic = strlen(WAL_MAGIC);
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < magic) {
+    fprintf(stderr, "Invalid reservation log %s\n", path);
+    close(fd);
+    return 1;
+  }
+
+  size_t size = (size_t)st.st_size;
+  const char *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "mmap error: %s\n", strerror(errno));
+    return 1;
+  }
+  if (memcmp(mapping, WAL_MAGIC, magic) != 0) {
+    fprintf(stderr, "Invalid reservation log %s\n", path);
+    munmap((void *)mapping, size);
+    return 1;
+  }
+
+  int result = 0;
+  size_t end = size;  // End of the last valid record
+  for (int pass = 0; pass < 2 && result == 0; pass++) {
+    uint32_t type = pass == 0 ? WAL_CREATE : WAL_RESERVE;
+    size_t offset = magic;
+
+    while (offset < end) {
+      // Copied out, records after the magic are not aligned
+      struct WalRecord record;
+      if (end - offset < sizeof(record)) {
+        end = offset;
+        break;
+      }
+      memcpy(&record, mapping + offset, sizeof(record));
+
+      size_t num_seats = record.type == WAL_RESERVE ? (size_t)record.b : 0;
+      if ((record.type != WAL_CREATE && record.type != WAL_RESERVE) || num_seats > MAX_RESERVATION_SIZE ||
+          end - offset - sizeof(record) < num_seats * sizeof(uint64_t)) {
+        end = offset;
+        break;
+      }
+      uint64_t seats[num_seats > 0 ? num_seats : 1];
+      memcpy(seats, mapping + offset + sizeof(record), num_seats * sizeof(uint64_t));
+      if (record.checksum != record_checksum(&record, seats, num_seats)) {
+        end = offset;
+        break;
+      }
+
+      if (record.type == type && apply(&record, seats, context) != 0) {
+        result = 1;
+        break;
+      }
+      offset += sizeof(record) + num_seats * sizeof(uint64_t);
+    }
+  }
+
+  // A crash while a batch was written leaves part of it behind, none of its records were committed
+  if (result == 0 && end < size)
+    fprintf(stderr, "Ignoring %zu bytes at the end of reservation log %s\n", size - end, path);
+
+  munmap((void *)mapping, size);
+  return result;
+}
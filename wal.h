@@ -0,0 +1,94 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "latency.h"
+
+#define WAL_MAGIC "EMSWAL01"  // First bytes of a log file
+#define WAL_BATCH_CLASSES 8   // Batches are grouped by size in powers of two, the last group takes the rest
+
+enum WalRecordType { WAL_CREATE = 1, WAL_RESERVE = 2 };
+
+// Log file: the magic, then records appended in the order they were committed.
+// A RESERVE record is followed by its seat indices as uint64_t. Numbers are in the byte order of the
+// machine that wrote the file.
+struct WalRecord {
+  uint32_t type;  // WalRecordType
+  uint32_t event_id;
+  uint64_t a;         // Rows of a CREATE, reservation id of a RESERVE
+  uint64_t b;         // Columns of a CREATE, number of seats of a RESERVE
+  uint64_t checksum;  // FNV-1a of the record with this field zeroed and of its seats
+};
+
+// Append-only log with group commit: threads append records to a buffer and a flusher thread makes
+// every record in it durable with a single write and fdatasync.
+struct WriteAheadLog {
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t pending;  // Signaled when the flusher has work to do
+  pthread_cond_t durable;  // Broadcast after every batch
+
+  char *buffer;  // Records not written yet
+  size_t used;
+  size_t capacity;
+  char *spare;   // Buffer of the batch being written, swapped with buffer
+  size_t spare_capacity;
+
+  unsigned long appended;      // Records appended so far
+  unsigned long synced;        // Records durable so far, always a prefix of the appended ones
+  struct timespec first_at;    // When the oldest record in buffer was appended
+  int closing;
+  int failed;  // Set when a batch could not be written, nothing is committed after that
+  pthread_t flusher;
+
+  unsigned long batches;
+  unsigned long bytes;
+  struct LatencyHistogram commit;                        // Time from append to durable, per record
+  struct LatencyHistogram by_batch[WAL_BATCH_CLASSES];  // Same for the oldest record of each batch, by batch size
+};
+
+/// Sets the time the flusher waits for more records once the first one of a batch arrives.
+/// @param interval_us Interval in microseconds, 0 to write a batch as soon as the flusher is free.
+void wal_set_interval(unsigned int interval_us);
+
+/// Creates a log, truncating the file, and starts its flusher.
+/// @param wal Log to initialize.
+/// @param path Path of the log file.
+/// @return 0 if the log was opened, 1 otherwise.
+int wal_open(struct WriteAheadLog *wal, const char *path);
+
+/// Appends records and waits until they are durable.
+/// @note The records go into the same batch, so appending many at once waits for a single write.
+/// @param wal Log to append to.
+/// @param records Records to append, their checksums are filled in.
+/// @param seats Seat indices of the RESERVE records, record->b for each of them one after the other.
+/// @param count Number of records.
+/// @return 0 if the records are durable, 1 otherwise.
+int wal_append(struct WriteAheadLog *wal, struct WalRecord *records, const uint64_t *seats, size_t count);
+
+/// Writes the records still buffered, stops the flusher and closes the log.
+/// @param wal Log to close.
+/// @return 0 if every record appended is durable, 1 otherwise.
+int wal_close(struct WriteAheadLog *wal);
+
+/// Writes the commit statistics of a log, one "name value" pair per line.
+/// @param wal Log to read, closed or not appended to anymore.
+/// @param fd File descriptor of the file to write to.
+/// @return 0 if everything was written, 1 otherwise.
+int wal_write_stats(const struct WriteAheadLog *wal, int fd);
+
+/// Reads every record of a log, stopping at the first torn or corrupt one.
+/// @note Every CREATE is applied before any RESERVE. Reservations never share seats, so their order does not
+/// matter.
+/// @param path Path of the log file.
+/// @param apply Called with each record and its seats, a nonzero return stops the replay.
+/// @param context Passed to apply.
+/// @return 0 if every record was applied, 1 otherwise.
+int wal_replay(const char *path, int (*apply)(const struct WalRecord *record, const uint64_t *seats, void *context),
+               void *context);
+
+#endif  // WAL_H